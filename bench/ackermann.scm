@@ -0,0 +1,11 @@
+;; Ackermann's function (ack 3 n): deep non-tail recursion.
+
+(define (ack m n)
+  (cond
+   ((= m 0) (+ n 1))
+   ((= n 0) (ack (- m 1) 1))
+   (else (ack (- m 1) (ack m (- n 1))))))
+
+(define (main args)
+  (display (ack 3 (if (null? args) 6 (string->number (car args)))))
+  (write-char #\newline))
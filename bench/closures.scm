@@ -0,0 +1,24 @@
+;; Make n counters, each a closure over a mutable variable, and bump
+;; each a hundred times through a procedure it is passed to.
+
+(define (make-counter)
+  (let ((count 0))
+    (lambda (k)
+      (set! count (+ count k))
+      count)))
+
+(define (bump counter times)
+  (if (= times 1)
+      (counter 1)
+      (begin
+        (counter 1)
+        (bump counter (- times 1)))))
+
+(define (run n total)
+  (if (= n 0)
+      total
+      (run (- n 1) (+ total (bump (make-counter) 100)))))
+
+(define (main args)
+  (display (run (if (null? args) 1000 (string->number (car args))) 0))
+  (write-char #\newline))
@@ -0,0 +1,21 @@
+;; Build and sum a list ten thousand deep with non-tail recursion, n
+;; times.
+
+(define (build n)
+  (if (= n 0)
+      '()
+      (cons n (build (- n 1)))))
+
+(define (sum lst)
+  (if (null? lst)
+      0
+      (+ (car lst) (sum (cdr lst)))))
+
+(define (repeat n acc)
+  (if (= n 0)
+      acc
+      (repeat (- n 1) (+ acc (sum (build 10000))))))
+
+(define (main args)
+  (display (repeat (if (null? args) 10 (string->number (car args))) 0))
+  (write-char #\newline))
@@ -0,0 +1,18 @@
+;; Arithmetic-heavy interpreter workload, run with SCHEME_GC_STATS set to
+;; count allocations.
+
+(define (fib n)
+  (if (< n 2)
+      n
+      (+ (fib (- n 1)) (fib (- n 2)))))
+
+(define (loop i acc)
+  (if (= i 0)
+      acc
+      (loop (- i 1) (+ acc i))))
+
+(define (main args)
+  (display (fib 22))
+  (write-char #\newline)
+  (display (loop 100000 0))
+  (write-char #\newline))
@@ -0,0 +1,10 @@
+;; Doubly recursive Fibonacci: non-tail calls and fixnum arithmetic.
+
+(define (fib n)
+  (if (< n 2)
+      n
+      (+ (fib (- n 1)) (fib (- n 2)))))
+
+(define (main args)
+  (display (fib (if (null? args) 25 (string->number (car args)))))
+  (write-char #\newline))
@@ -0,0 +1,49 @@
+/* Run a command and write its wall clock time in seconds and its peak
+   resident set size in kilobytes, separated by a tab, to a file:
+
+     measure out-file command [arg...]
+
+   The command's output and exit status are passed through. */
+
+#include <stdio.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+int main(int argc, char *argv[])
+{
+  if (argc < 3) {
+    fprintf(stderr, "usage: measure out-file command [arg...]\n");
+    return 2;
+  }
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  pid_t pid = fork();
+  if (pid == 0) {
+    execvp(argv[2], argv + 2);
+    perror(argv[2]);
+    _exit(127);
+  }
+
+  int status;
+  struct rusage usage;
+  if (pid < 0 || wait4(pid, &status, 0, &usage) < 0) {
+    perror("measure");
+    return 2;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  FILE *out = fopen(argv[1], "w");
+  if (out == NULL) {
+    perror(argv[1]);
+    return 2;
+  }
+  fprintf(out, "%.3f\t%ld\n",
+          (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9,
+          usage.ru_maxrss);
+  fclose(out);
+
+  return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
@@ -0,0 +1,27 @@
+;; Count the solutions to the n queens problem, keeping the queens placed
+;; so far in a list.
+
+(define (safe? row dist placed)
+  (cond
+   ((null? placed) #t)
+   ((= (car placed) row) #f)
+   ((= (car placed) (+ row dist)) #f)
+   ((= (car placed) (- row dist)) #f)
+   (else (safe? row (+ dist 1) (cdr placed)))))
+
+(define (try-rows n row k placed)
+  (if (= row n)
+      0
+      (+ (if (safe? row 1 placed)
+             (place n (+ k 1) (cons row placed))
+             0)
+         (try-rows n (+ row 1) k placed))))
+
+(define (place n k placed)
+  (if (= k n)
+      1
+      (try-rows n 0 k placed)))
+
+(define (main args)
+  (display (place (if (null? args) 6 (string->number (car args))) 0 '()))
+  (write-char #\newline))
@@ -0,0 +1,8 @@
+;; Output-heavy compiled workload: print a list of 500k pairs.
+
+(define (build n acc)
+  (if (fxzero? n)
+      acc
+      (build (fxsub1 n) (cons (cons n 'element) acc))))
+
+(build 500000 '())
@@ -0,0 +1,58 @@
+#!/bin/bash
+# Run each benchmark under the interpreter and compiled, and write a
+# tab-separated line for each run to a results file:
+#
+#   benchmark engine flags size seconds max-rss-kb allocations
+#
+#   bench/run.sh results-file [benchmark...]
+#
+# The engine is bootstrap, run with BOOTSTRAP_FLAGS, or compiled, for the
+# program generated with COMPILER_FLAGS and built with the C compiler
+# flags BENCH_CFLAGS. The interpreter is given smaller sizes, so that each run
+# takes around a second on both. Allocations are counted by the garbage
+# collector's statistics.
+
+set -e
+cd "$(dirname "$0")/.."
+
+# benchmark, size for the interpreter, size compiled
+SIZES="fib 29 39
+tak 50 4000
+ackermann 8 11
+nqueens 10 12
+sort 5000 50000
+closures 10000 2000000
+deep-recursion 60 1000"
+
+results=$1
+shift
+benchmarks=${*:-$(echo "$SIZES" | cut -d' ' -f1)}
+cflags=${BENCH_CFLAGS:--O2}
+interpreter_flags=${BOOTSTRAP_FLAGS:--}
+compiled_flags=$(echo $COMPILER_FLAGS $cflags)
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+# run name engine flags size command...
+run() {
+  local name=$1 engine=$2 flags=$3 size=$4
+  shift 4
+  SCHEME_GC_STATS=1 bench/measure "$tmp/measure" "$@" > "$tmp/out" 2> "$tmp/err" || {
+    cat "$tmp/err" >&2
+    echo "$name failed under $engine" >&2
+    exit 1
+  }
+  local allocations=$(sed -n 's/.* \([0-9]*\) objects.*/\1/p' "$tmp/err")
+  printf '%s\t%s\t%s\t%s\t%s\t%s\n' "$name" "$engine" "$flags" "$size" "$(cat "$tmp/measure")" "$allocations" |
+    tee -a "$results"
+}
+
+printf 'benchmark\tengine\tflags\tsize\tseconds\tmax_rss_kb\tallocations\n' > "$results"
+for name in $benchmarks; do
+  sizes=$(echo "$SIZES" | grep "^$name ") || { echo "no benchmark $name" >&2; exit 1; }
+  set -- $sizes
+  run $name bootstrap "$interpreter_flags" $2 ./bootstrap $BOOTSTRAP_FLAGS bench/$name.scm $2
+  ./bootstrap compiler.scm $COMPILER_FLAGS bench/$name.scm > "$tmp/$name.c"
+  cc $cflags -I. -o "$tmp/$name" "$tmp/$name.c" runtime.c
+  run $name compiled "$compiled_flags" $3 "$tmp/$name" $3
+done
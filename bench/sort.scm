@@ -0,0 +1,51 @@
+;; Merge sort a list of n numbers in scrambled order, ten times. Every
+;; procedure is tail recursive, so long lists need no deep stack.
+
+(define (wrap x m)
+  (if (< x m) x (wrap (- x m) m)))
+
+;; (i * 7919) mod n for i from 0 to n-1, a permutation when n is not a
+;; multiple of 7919
+(define (scrambled n)
+  (define (loop i x acc)
+    (if (= i n)
+        acc
+        (loop (+ i 1) (wrap (+ x 7919) n) (cons x acc))))
+  (loop 0 0 '()))
+
+(define (reverse-onto lst acc)
+  (if (null? lst)
+      acc
+      (reverse-onto (cdr lst) (cons (car lst) acc))))
+
+(define (split lst a b)
+  (if (null? lst)
+      (cons a b)
+      (split (cdr lst) b (cons (car lst) a))))
+
+(define (merge a b acc)
+  (cond
+   ((null? a) (reverse-onto acc b))
+   ((null? b) (reverse-onto acc a))
+   ((< (car b) (car a)) (merge a (cdr b) (cons (car b) acc)))
+   (else (merge (cdr a) b (cons (car a) acc)))))
+
+(define (sort lst)
+  (if (or (null? lst) (null? (cdr lst)))
+      lst
+      (let ((halves (split lst '() '())))
+        (merge (sort (car halves)) (sort (cdr halves)) '()))))
+
+(define (last lst)
+  (if (null? (cdr lst)) (car lst) (last (cdr lst))))
+
+(define (repeat k lst)
+  (let ((sorted (sort lst)))
+    (if (= k 1)
+        sorted
+        (repeat (- k 1) lst))))
+
+(define (main args)
+  (let ((sorted (repeat 10 (scrambled (if (null? args) 1000 (string->number (car args)))))))
+    (display (list (car sorted) (last sorted)))
+    (write-char #\newline)))
@@ -0,0 +1,17 @@
+;; Takeuchi's function, repeated n times: calls with three arguments.
+
+(define (tak x y z)
+  (if (< y x)
+      (tak (tak (- x 1) y z)
+           (tak (- y 1) z x)
+           (tak (- z 1) x y))
+      z))
+
+(define (repeat n acc)
+  (if (= n 0)
+      acc
+      (repeat (- n 1) (+ acc (tak 18 12 6)))))
+
+(define (main args)
+  (display (repeat (if (null? args) 10 (string->number (car args))) 0))
+  (write-char #\newline))
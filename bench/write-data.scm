@@ -0,0 +1,13 @@
+;; Output-heavy interpreter workload: read the file named on the command
+;; line and write its first form back ten times.
+
+(define (repeat n x)
+  (if (= n 0)
+      'done
+      (begin
+        (write x)
+        (write-char #\newline)
+        (repeat (- n 1) x))))
+
+(define (main args)
+  (repeat 10 (read (open-input-file (car args)))))
@@ -1,18 +1,29 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <stddef.h>
 #include <string.h>
 #include <setjmp.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 jmp_buf errbuf;
 
+void flushwriters();
+
 #define ERROR(fmt, ...)				\
   do {						\
+    flushwriters();				\
     fprintf(stderr, fmt, ##__VA_ARGS__);	\
     longjmp(errbuf, 1);				\
   } while (0);
 
-typedef enum { NUMBER, BOOLEAN, CHAR, STRING, SYMBOL, PAIR, _NULL, PRIM_PROC, COMP_PROC, _EOF, INPUT_PORT, OUTPUT_PORT } Type;
+typedef enum { NUMBER, BOOLEAN, CHAR, STRING, SYMBOL, PAIR, _NULL, PRIM_PROC, COMP_PROC, _EOF, INPUT_PORT, OUTPUT_PORT,
+	       FRAME, TABLE, ENVIRONMENT, CODE, CONST_NODE, LOCAL_REF_NODE, GLOBAL_REF_NODE, LOCAL_SET_NODE, GLOBAL_SET_NODE,
+	       DEFINE_NODE, IF_NODE, LAMBDA_NODE, SEQ_NODE, AND_NODE, OR_NODE, APPLY_NODE, EVAL_NODE,
+	       CALL_NODE,
+	       _FORWARD } Type;
 
 typedef struct sObj {
   Type type;
@@ -20,17 +31,13 @@ typedef struct sObj {
     struct {
       long val;
     } fixnum;
-    struct {
-      int val;
-    } boolean;
-    struct {
-      char val;
-    } _char;
     struct {
       char *val;
     } string;
     struct {
       char *name;
+      size_t len;
+      unsigned long hash;
     } symbol;
     struct {
       struct sObj *car;
@@ -40,19 +47,87 @@ typedef struct sObj {
       struct sObj *(*proc)(struct sObj *args);
     } primproc;
     struct {
-      struct sObj *formals;
-      struct sObj *body;
+      struct sObj *lambda;
       struct sObj *env;
     } compproc;
     struct {
-      FILE *in;
+      struct sReader *reader;
     } inputport;
     struct {
-      FILE *out;
+      struct sWriter *writer;
     } outputport;
+    struct {
+      struct sObj *parent;
+      long size;
+    } frame;
+    struct {
+      long size;
+    } table;
+    struct {
+      struct sObj *table;
+      long count;
+    } environment;
+    struct {
+      struct sObj *consts;
+      int arity;
+      int framesize;
+      int maxdepth;
+      int size;
+    } code;
+    struct {
+      struct sObj *a;
+      struct sObj *b;
+      struct sObj *c;
+    } node;
+    struct {
+      struct sObj *to;
+    } forward;
   } data;
 } Obj;
 
+/* Fixnums, characters and booleans are immediates tagged in the low bits
+   of the Obj pointer, using the same scheme as runtime.h. Heap objects
+   are 16-byte aligned so their low four bits are zero. Fixnums too large
+   for an immediate are boxed in a NUMBER object. */
+
+#define immask 15
+
+#define fxshift 1
+#define fxmask  1
+#define fxtag   1
+
+#define cshift 4
+#define cmask  immask
+#define ctag   10
+
+#define bshift 4
+#define bmask  immask
+#define btag   6
+
+#define FXMAX ((1L << (8 * sizeof(long) - 2)) - 1)
+#define FXMIN (-FXMAX - 1)
+
+#define TAGGED(o, mask, tag) (((size_t)(o) & (mask)) == (tag))
+#define IMMEDIATE(val, shift, tag) ((Obj *)(((size_t)(val) << (shift)) | (tag)))
+
+#define ISIMMEDIATE(o) (!TAGGED(o, immask, 0))
+#define ISFIXNUM(o) TAGGED(o, fxmask, fxtag)
+#define ISCHAR(o) TAGGED(o, cmask, ctag)
+#define ISBOOLEAN(o) TAGGED(o, bmask, btag)
+
+#define CHARVAL(o) ((char)((size_t)(o) >> cshift))
+
+Type gettype(Obj *o)
+{
+  if (ISFIXNUM(o))
+    return NUMBER;
+  if (ISCHAR(o))
+    return CHAR;
+  if (ISBOOLEAN(o))
+    return BOOLEAN;
+  return o->type;
+}
+
 #define DECLARE_CONSTANT(name)			\
   Obj *the##name;				\
   int is##name(Obj *o)				\
@@ -83,14 +158,269 @@ DECLARE_CONSTANT(or);
 DECLARE_CONSTANT(apply);
 DECLARE_CONSTANT(eval);
 
-Obj *allocobj()
+/* Garbage collection
+
+   Objects live in a semispace heap managed by a Cheney-style copying
+   collector. Roots are the global objects in globalroots and the
+   addresses of C variables registered with PROTECT. Any function that
+   holds an Obj * across a call that may allocate must PROTECT it first
+   and UNPROTECT (or GCRESTORE) before returning. */
+
+#define INITIAL_HEAP_SIZE (1 << 20)
+#define INITIAL_ROOTS 1024
+
+char *heapbase;
+char *heapfree;
+char *heaplimit;
+size_t heapsize;
+
+char *sparebase;
+size_t sparesize;
+
+size_t livebytes;
+size_t peaklivebytes;
+size_t allocatedbytes;
+long allocations;
+long collections;
+
+int gcstress;
+
+Obj ***gcroots;
+int gcnroots;
+int gcrootcap;
+
+void growroots()
+{
+  gcrootcap = gcrootcap ? 2 * gcrootcap : INITIAL_ROOTS;
+  gcroots = realloc(gcroots, gcrootcap * sizeof(Obj **));
+}
+
+#define PROTECT(o)				\
+  do {						\
+    if (gcnroots == gcrootcap)			\
+      growroots();				\
+    gcroots[gcnroots++] = &(o);			\
+  } while (0)
+
+#define UNPROTECT(n) (gcnroots -= (n))
+
+#define GCSAVE int gcsaved = gcnroots
+#define GCRESTORE (gcnroots = gcsaved)
+#define GCRETURN(x)				\
+  do {						\
+    Obj *gcret = (x);				\
+    GCRESTORE;					\
+    return gcret;				\
+  } while (0)
+
+#define ALIGN(n) (((n) + 15) & ~(size_t)15)
+
+/* the slots of a frame or table follow it in the heap */
+#define FRAMESLOTS(o) ((Obj **)((o) + 1))
+#define TABLESLOTS(o) ((Obj **)((o) + 1))
+/* and so do the instructions of a code object */
+#define CODEWORDS(o) ((long *)((o) + 1))
+
+size_t objsize(Obj *o)
+{
+  if (o->type == _FORWARD)
+    return objsize(o->data.forward.to);
+  if (o->type == FRAME)
+    return ALIGN(sizeof(Obj) + o->data.frame.size * sizeof(Obj *));
+  if (o->type == TABLE)
+    return ALIGN(sizeof(Obj) + o->data.table.size * sizeof(Obj *));
+  if (o->type == CODE)
+    return ALIGN(sizeof(Obj) + o->data.code.size * sizeof(long));
+  return ALIGN(sizeof(Obj));
+}
+
+int inheap(Obj *o, char *base, char *limit)
+{
+  return (char *)o >= base && (char *)o < limit;
+}
+
+/* every object lives in the heap, so anything else is a stale pointer */
+Obj *gccopy(Obj *o, char **next)
+{
+  if (o == NULL || ISIMMEDIATE(o))
+    return o;
+  if (!inheap(o, heapbase, heapfree)) {
+    fprintf(stderr, "gc: stale pointer %p\n", (void *)o);
+    abort();
+  }
+  if (o->type == _FORWARD)
+    return o->data.forward.to;
+
+  size_t size = objsize(o);
+  Obj *copy = (Obj *)*next;
+  memcpy(copy, o, size);
+  *next += size;
+
+  o->type = _FORWARD;
+  o->data.forward.to = copy;
+  return copy;
+}
+
+void gcscan(Obj *o, char **next)
+{
+  switch (o->type) {
+  case PAIR:
+    o->data.pair.car = gccopy(o->data.pair.car, next);
+    o->data.pair.cdr = gccopy(o->data.pair.cdr, next);
+    break;
+  case COMP_PROC:
+    o->data.compproc.lambda = gccopy(o->data.compproc.lambda, next);
+    o->data.compproc.env = gccopy(o->data.compproc.env, next);
+    break;
+  case FRAME:
+    o->data.frame.parent = gccopy(o->data.frame.parent, next);
+    for (long i = 0; i < o->data.frame.size; ++i)
+      FRAMESLOTS(o)[i] = gccopy(FRAMESLOTS(o)[i], next);
+    break;
+  case TABLE:
+    for (long i = 0; i < o->data.table.size; ++i)
+      TABLESLOTS(o)[i] = gccopy(TABLESLOTS(o)[i], next);
+    break;
+  case ENVIRONMENT:
+    o->data.environment.table = gccopy(o->data.environment.table, next);
+    break;
+  case CODE:
+    o->data.code.consts = gccopy(o->data.code.consts, next);
+    break;
+  case CONST_NODE:
+  case LOCAL_REF_NODE:
+  case GLOBAL_REF_NODE:
+  case LOCAL_SET_NODE:
+  case GLOBAL_SET_NODE:
+  case DEFINE_NODE:
+  case IF_NODE:
+  case LAMBDA_NODE:
+  case SEQ_NODE:
+  case AND_NODE:
+  case OR_NODE:
+  case APPLY_NODE:
+  case EVAL_NODE:
+  case CALL_NODE:
+    o->data.node.a = gccopy(o->data.node.a, next);
+    o->data.node.b = gccopy(o->data.node.b, next);
+    o->data.node.c = gccopy(o->data.node.c, next);
+    break;
+  default:
+    break;
+  }
+}
+
+/* strings own a malloc'd buffer which must be released when they die */
+void gcsweep(char *base, char *limit)
+{
+  for (char *p = base; p < limit; p += objsize((Obj *)p)) {
+    Obj *o = (Obj *)p;
+    if (o->type == STRING)
+      free(o->data.string.val);
+  }
+}
+
+extern Obj **globalroots[];
+extern Obj **symtab;
+extern size_t symtabsize;
+void vmgcroots(char **next);
+
+void gc(size_t need)
+{
+  size_t size = heapsize;
+  while (size < 2 * (livebytes + need))
+    size *= 2;
+  if (size != sparesize) {
+    free(sparebase);
+    sparebase = malloc(size);
+    sparesize = size;
+    if (sparebase == NULL) {
+      fprintf(stderr, "out of memory\n");
+      exit(1);
+    }
+  }
+
+  char *scan = sparebase;
+  char *next = sparebase;
+
+  for (Obj ***r = globalroots; *r != NULL; ++r)
+    **r = gccopy(**r, &next);
+  for (int i = 0; i < gcnroots; ++i)
+    *gcroots[i] = gccopy(*gcroots[i], &next);
+  for (size_t i = 0; i < symtabsize; ++i)
+    symtab[i] = gccopy(symtab[i], &next);
+  vmgcroots(&next);
+
+  while (scan < next) {
+    Obj *o = (Obj *)scan;
+    gcscan(o, &next);
+    scan += objsize(o);
+  }
+
+  gcsweep(heapbase, heapfree);
+  if (gcstress)
+    memset(heapbase, 0xdb, heapfree - heapbase);
+
+  char *oldbase = heapbase;
+  size_t oldsize = heapsize;
+
+  heapbase = sparebase;
+  heapsize = sparesize;
+  heapfree = next;
+  heaplimit = heapbase + heapsize;
+
+  sparebase = oldbase;
+  sparesize = oldsize;
+
+  livebytes = heapfree - heapbase;
+  if (livebytes > peaklivebytes)
+    peaklivebytes = livebytes;
+  ++collections;
+}
+
+Obj *allocbytes(size_t size)
 {
-  Obj *o = malloc(sizeof(Obj));
+  size = ALIGN(size);
+  if (gcstress)
+    gc(size);
+  while (heapfree + size > heaplimit)
+    gc(size);
+  Obj *o = (Obj *)heapfree;
+  heapfree += size;
+  allocatedbytes += size;
+  ++allocations;
+  memset(o, 0, size);
   return o;
 }
 
+Obj *allocobj()
+{
+  return allocbytes(sizeof(Obj));
+}
+
+void gcstats()
+{
+  fprintf(stderr, "gc: %ld collections, %ld objects (%zu bytes) allocated, peak live %zu bytes, heap %zu bytes\n",
+	  collections, allocations, allocatedbytes, peaklivebytes, heapsize);
+}
+
+void initgc()
+{
+  heapsize = sparesize = INITIAL_HEAP_SIZE;
+  heapbase = heapfree = malloc(heapsize);
+  heaplimit = heapbase + heapsize;
+  sparebase = malloc(sparesize);
+
+  gcstress = getenv("SCHEME_GC_STRESS") != NULL;
+  if (getenv("SCHEME_GC_STATS") != NULL)
+    atexit(gcstats);
+}
+
 Obj *makefixnum(long l)
 {
+  if (l >= FXMIN && l <= FXMAX)
+    return IMMEDIATE(l, fxshift, fxtag);
+
   Obj *fixnum = allocobj();
   fixnum->type = NUMBER;
   fixnum->data.fixnum.val = l;
@@ -99,18 +429,12 @@ Obj *makefixnum(long l)
 
 Obj *makeboolean(int x)
 {
-  Obj *boolean = allocobj();
-  boolean->type = BOOLEAN;
-  boolean->data.boolean.val = x;
-  return boolean;
+  return IMMEDIATE(x != 0, bshift, btag);
 }
 
 Obj *makechar(char c)
 {
-  Obj *_char = allocobj();
-  _char->type = CHAR;
-  _char->data._char.val = c;
-  return _char;
+  return IMMEDIATE((unsigned char)c, cshift, ctag);
 }
 
 
@@ -119,7 +443,8 @@ Obj *makestring(char *buffer, int len)
   Obj *string = allocobj();
   string->type = STRING;
   string->data.string.val = malloc(len);
-  strncpy(string->data.string.val, buffer, len);
+  memcpy(string->data.string.val, buffer, len - 1);
+  string->data.string.val[len - 1] = '\0';
   return string;
 }
 
@@ -178,7 +503,10 @@ void setcdr(Obj *pair, Obj *o)
 
 Obj *cons(Obj *car, Obj *cdr)
 {
+  PROTECT(car);
+  PROTECT(cdr);
   Obj *pair = allocobj();
+  UNPROTECT(2);
   pair->type = PAIR;
   setcar(pair, car);
   setcdr(pair, cdr);
@@ -187,20 +515,78 @@ Obj *cons(Obj *car, Obj *cdr)
 
 #define PUSH(o, list) list = cons(o, list)
 
-Obj *interned;
+/* Symbols are interned in an open-addressed hash table keyed on their
+   names. The table is the only thing keeping most symbols alive, so gc()
+   treats its entries as roots and updates them when symbols move. */
+
+#define INITIAL_SYMTAB_SIZE 1024
+
+Obj **symtab;
+size_t symtabsize;
+size_t nsymbols;
+
+/* FNV-1a */
+unsigned long hashname(char *name, size_t len)
+{
+  unsigned long hash = 14695981039346656037UL;
+  for (size_t i = 0; i < len; ++i) {
+    hash ^= (unsigned char)name[i];
+    hash *= 1099511628211UL;
+  }
+  return hash;
+}
+
+/* The slot holding the symbol with this name, or the empty slot where it
+   belongs. */
+Obj **symslot(char *name, size_t len, unsigned long hash)
+{
+  size_t mask = symtabsize - 1;
+  for (size_t i = hash & mask;; i = (i + 1) & mask) {
+    Obj *s = symtab[i];
+    if (s == NULL ||
+        (s->data.symbol.hash == hash && s->data.symbol.len == len &&
+         memcmp(s->data.symbol.name, name, len) == 0))
+      return &symtab[i];
+  }
+}
+
+void growsymtab()
+{
+  Obj **old = symtab;
+  size_t oldsize = symtabsize;
+
+  symtabsize *= 2;
+  symtab = calloc(symtabsize, sizeof(Obj *));
+  for (size_t i = 0; i < oldsize; ++i)
+    if (old[i] != NULL) {
+      Obj *s = old[i];
+      *symslot(s->data.symbol.name, s->data.symbol.len, s->data.symbol.hash) = s;
+    }
+  free(old);
+}
 
+/* len includes the terminating NUL */
 Obj *makesymbol(char *buffer, int len)
 {
-  for (Obj *o = interned; !isnull(o); o = cdr(o))
-    if (strncmp(car(o)->data.symbol.name, buffer, len) == 0)
-      return car(o);
+  size_t n = len - 1;
+  unsigned long hash = hashname(buffer, n);
+  Obj **slot = symslot(buffer, n, hash);
+  if (*slot != NULL)
+    return *slot;
 
+  /* a collection moves the entries of symtab but not the table itself,
+     so slot stays valid across the allocation */
   Obj *symbol = allocobj();
   symbol->type = SYMBOL;
-  symbol->data.symbol.name = malloc(len);
-  strncpy(symbol->data.symbol.name, buffer, len);
+  symbol->data.symbol.name = malloc(n + 1);
+  memcpy(symbol->data.symbol.name, buffer, n);
+  symbol->data.symbol.name[n] = '\0';
+  symbol->data.symbol.len = n;
+  symbol->data.symbol.hash = hash;
+  *slot = symbol;
 
-  PUSH(symbol, interned);
+  if (4 * ++nsymbols > 3 * symtabsize)
+    growsymtab();
 
   return symbol;
 }
@@ -213,16 +599,30 @@ Obj *makeprimproc(Obj *(*proc)(Obj *args))
   return primproc;
 }
 
-Obj *makecompproc(Obj *formals, Obj *body, Obj *env)
+Obj *makecompproc(Obj *lambda, Obj *env)
 {
+  PROTECT(lambda);
+  PROTECT(env);
   Obj *compproc = allocobj();
+  UNPROTECT(2);
   compproc->type = COMP_PROC;
-  compproc->data.compproc.formals = formals;
-  compproc->data.compproc.body = body;
+  compproc->data.compproc.lambda = lambda;
   compproc->data.compproc.env = env;
   return compproc;
 }
 
+/* the slots of a frame start out NULL, meaning unassigned */
+Obj *makeframe(long size, Obj *parent)
+{
+  PROTECT(parent);
+  Obj *frame = allocbytes(sizeof(Obj) + size * sizeof(Obj *));
+  UNPROTECT(1);
+  frame->type = FRAME;
+  frame->data.frame.parent = parent;
+  frame->data.frame.size = size;
+  return frame;
+}
+
 Obj *makeeof()
 {
   Obj *eof = allocobj();
@@ -230,22 +630,201 @@ Obj *makeeof()
   return eof;
 }
 
-Obj *makeinputport(FILE* in)
+/* Output goes through a large buffer which is handed to stdio in one
+   call when it fills, when the port is flushed or closed, before stdin
+   is read, before an error is reported and at exit */
+#define WRITER_BUFFER_LEN 65536
+
+typedef struct sWriter {
+  FILE *file;
+  size_t len;
+  struct sWriter *next;
+  char buf[WRITER_BUFFER_LEN];
+} Writer;
+
+Writer *writers;
+
+Writer *makewriter(FILE *file)
+{
+  Writer *w = malloc(sizeof(Writer));
+  w->file = file;
+  w->len = 0;
+  w->next = writers;
+  writers = w;
+  return w;
+}
+
+void flushwriter(Writer *w)
+{
+  if (w->len != 0 && w->file != NULL)
+    fwrite(w->buf, 1, w->len, w->file);
+  w->len = 0;
+  if (w->file != NULL)
+    fflush(w->file);
+}
+
+void flushwriters()
+{
+  for (Writer *w = writers; w != NULL; w = w->next)
+    flushwriter(w);
+}
+
+void closewriter(Writer *w)
+{
+  flushwriter(w);
+  if (w->file != NULL)
+    fclose(w->file);
+  w->file = NULL;
+}
+
+void wputn(Writer *w, char *s, size_t n)
+{
+  if (w->len + n > WRITER_BUFFER_LEN) {
+    flushwriter(w);
+    if (n > WRITER_BUFFER_LEN) {
+      if (w->file != NULL)
+	fwrite(s, 1, n, w->file);
+      return;
+    }
+  }
+  memcpy(w->buf + w->len, s, n);
+  w->len += n;
+}
+
+void wputs(Writer *w, char *s)
+{
+  wputn(w, s, strlen(s));
+}
+
+void wputc(Writer *w, char c)
+{
+  if (w->len == WRITER_BUFFER_LEN)
+    flushwriter(w);
+  w->buf[w->len++] = c;
+}
+
+void wputl(Writer *w, long l)
+{
+  char digits[24];
+  char *p = digits + sizeof(digits);
+  unsigned long u = l < 0 ? -(unsigned long)l : (unsigned long)l;
+  do
+    *--p = '0' + u % 10;
+  while ((u /= 10) != 0);
+  if (l < 0)
+    *--p = '-';
+  wputn(w, p, digits + sizeof(digits) - p);
+}
+
+Writer *stdoutwriter;
+Writer *stderrwriter;
+
+/* The reader scans a buffer with a pointer rather than calling getc for
+   each character. A regular file is mapped into memory whole; anything
+   else, such as a terminal or a pipe, is read a line at a time. */
+typedef struct sReader {
+  FILE *file;
+  char *base;
+  size_t cap;	/* capacity of the line buffer, or 0 when mapped */
+  size_t maplen;
+  char *pos;
+  char *end;
+} Reader;
+
+Reader *makereader(FILE *file)
+{
+  Reader *r = calloc(1, sizeof(Reader));
+  r->file = file;
+  struct stat st;
+  if (file != NULL && file != stdin && fstat(fileno(file), &st) == 0 &&
+      S_ISREG(st.st_mode) && st.st_size > 0) {
+    char *base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+    if (base != MAP_FAILED) {
+      r->base = r->pos = base;
+      r->end = base + st.st_size;
+      r->maplen = st.st_size;
+    }
+  }
+  return r;
+}
+
+Reader *openreader(char *path)
+{
+  FILE *file = fopen(path, "r");
+  if (file == NULL)
+    ERROR("could not open %s\n", path);
+  return makereader(file);
+}
+
+void closereader(Reader *r)
+{
+  if (r->maplen != 0)
+    munmap(r->base, r->maplen);
+  else
+    free(r->base);
+  if (r->file != NULL)
+    fclose(r->file);
+  r->file = NULL;
+  r->base = r->pos = r->end = NULL;
+  r->cap = r->maplen = 0;
+}
+
+/* Refill the buffer with the next line, or return 0 at end of file */
+int fillreader(Reader *r)
+{
+  if (r->maplen != 0 || r->file == NULL)
+    return 0;
+  if (r->file == stdin)
+    flushwriter(stdoutwriter);
+  ssize_t n = getline(&r->base, &r->cap, r->file);
+  if (n <= 0)
+    return 0;
+  r->pos = r->base;
+  r->end = r->base + n;
+  return 1;
+}
+
+static inline int peek(Reader *r)
+{
+  return r->pos < r->end || fillreader(r) ? (unsigned char)*r->pos : EOF;
+}
+
+static inline int nextchar(Reader *r)
+{
+  return r->pos < r->end || fillreader(r) ? (unsigned char)*r->pos++ : EOF;
+}
+
+Reader *stdinreader;
+
+Obj *makeinputport(Reader *reader)
 {
   Obj *inputport = allocobj();
   inputport->type = INPUT_PORT;
-  inputport->data.inputport.in = in;
+  inputport->data.inputport.reader = reader;
   return inputport;
 }
 
-Obj *makeoutputport(FILE* out)
+Obj *makeoutputport(Writer *writer)
 {
   Obj *outputport = allocobj();
   outputport->type = OUTPUT_PORT;
-  outputport->data.outputport.out = out;
+  outputport->data.outputport.writer = writer;
   return outputport;
 }
 
+/* The value of a number. Other objects are read through the union as
+   they were before immediates existed. */
+long numval(Obj *o)
+{
+  if (ISFIXNUM(o))
+    return (long)o >> fxshift;
+  if (ISCHAR(o))
+    return (unsigned char)CHARVAL(o);
+  if (ISBOOLEAN(o))
+    return (size_t)o >> bshift;
+  return o->data.fixnum.val;
+}
+
 int length(Obj *pair)
 {
   int len = 0;
@@ -257,7 +836,7 @@ Obj *add(Obj *args)
 {
   long sum = 0;
   for (Obj *o = args; !isnull(o); o = cdr(o))
-    sum += car(o)->data.fixnum.val;
+    sum += numval(car(o));
   return makefixnum(sum);
 }
 
@@ -265,11 +844,11 @@ Obj *sub(Obj *args)
 {
   long sum;
   if (length(args) == 1)
-    return makefixnum(-car(args)->data.fixnum.val);
+    return makefixnum(-numval(car(args)));
 
-  sum = car(args)->data.fixnum.val;
+  sum = numval(car(args));
   for (Obj *o = cdr(args); !isnull(o); o = cdr(o))
-    sum -= car(o)->data.fixnum.val;
+    sum -= numval(car(o));
   return makefixnum(sum);
 }
 
@@ -277,13 +856,25 @@ Obj *mul(Obj *args)
 {
   long product = 1;
   for (Obj *o = args; !isnull(o); o = cdr(o))
-    product *= car(o)->data.fixnum.val;
+    product *= numval(car(o));
   return makefixnum(product);
 }
 
 Obj *lsh(Obj *args)
 {
-  return makefixnum(car(args)->data.fixnum.val << cadr(args)->data.fixnum.val);
+  return makefixnum(numval(car(args)) << numval(cadr(args)));
+}
+
+/* Symbols compare by name, so that the order compiler.scm keeps sets
+   and trees of them in does not depend on where they were allocated,
+   and is the same when the compiler is itself compiled. */
+long compare(Obj *a, Obj *b)
+{
+  if (gettype(a) == SYMBOL && gettype(b) == SYMBOL)
+    return strcmp(a->data.symbol.name, b->data.symbol.name);
+  long x = numval(a);
+  long y = numval(b);
+  return (x > y) - (x < y);
 }
 
 #define FIXNUM_TRUE_FOR_PAIRS(procname, name, op)			\
@@ -291,7 +882,7 @@ Obj *lsh(Obj *args)
   {									\
     Obj *last = car(args);						\
     for (Obj *o = cdr(args); !isnull(o); last = car(o), o = cdr(o))	\
-      if (!(last->data.fixnum.val op car(o)->data.fixnum.val))		\
+      if (!(compare(last, car(o)) op 0))				\
 	return thefalse;						\
     return thetrue;							\
   }
@@ -305,7 +896,7 @@ FIXNUM_TRUE_FOR_PAIRS(fixnumle, "<=", <=);
 #define TYPE_PREDICATE(name, _type)		\
   Obj* name##p(Obj *args)			\
   {						\
-    return TOBOOLEAN(car(args)->type == _type);	\
+    return TOBOOLEAN(gettype(car(args)) == _type);	\
   }
 
 TYPE_PREDICATE(number, NUMBER);
@@ -321,18 +912,38 @@ TYPE_PREDICATE(outputport, OUTPUT_PORT);
 
 Obj *procedurep(Obj *args)
 {
-  return TOBOOLEAN(car(args)->type == PRIM_PROC || car(args)->type == COMP_PROC);
+  return TOBOOLEAN(gettype(car(args)) == PRIM_PROC || gettype(car(args)) == COMP_PROC);
+}
+
+Obj *chartointeger(Obj *args)
+{
+  return makefixnum((unsigned char)CHARVAL(car(args)));
 }
 
 Obj *numbertostring(Obj *args)
 {
-  long val = car(args)->data.fixnum.val;
+  long val = numval(car(args));
   int len = snprintf(NULL, 0, "%ld", val) + 1;
-  char *buffer = malloc(len);
+  char buffer[len];
   snprintf(buffer, len, "%ld", val);
   return makestring(buffer, len);
 }
 
+/* #f unless the whole string is a decimal integer which fits in a
+   long. strtol would also skip leading whitespace and a plus sign. */
+Obj *stringtonumber(Obj *args)
+{
+  char *str = car(args)->data.string.val;
+  if (!isdigit((unsigned char)str[*str == '-']))
+    return thefalse;
+  char *end;
+  errno = 0;
+  long val = strtol(str, &end, 10);
+  if (*end != '\0' || errno == ERANGE)
+    return thefalse;
+  return makefixnum(val);
+}
+
 Obj *stringtosymbol(Obj *args)
 {
   char *str = car(args)->data.string.val;
@@ -341,8 +952,8 @@ Obj *stringtosymbol(Obj *args)
 
 Obj *symboltostring(Obj *args)
 {
-  char *name = car(args)->data.symbol.name;
-  return makestring(name, strlen(name) + 1);
+  Obj *symbol = car(args);
+  return makestring(symbol->data.symbol.name, symbol->data.symbol.len + 1);
 }
 
 Obj *stringlength(Obj *args)
@@ -362,7 +973,9 @@ Obj *stringappend(Obj *args)
   for (Obj *o = args; !isnull(o); o = cdr(o))
     b = stpcpy(b, car(o)->data.string.val);
 
-  return makestring(buffer, len);
+  Obj *string = makestring(buffer, len);
+  free(buffer);
+  return string;
 }
 
 Obj *lengthproc(Obj *args)
@@ -409,10 +1022,93 @@ Obj *eq(Obj *args)
 
 #define MAKE_CONSTANT_SYMBOL(str) makesymbol(str, sizeof(str))
 #define INIT_CONSTANT_SYMBOL(name) the##name = MAKE_CONSTANT_SYMBOL(#name)
-#define MAKE_PRIM_PROC(env, name, proc) PUSH(cons(MAKE_CONSTANT_SYMBOL(#name), makeprimproc(proc)), env)
+#define MAKE_PRIM_PROC(env, name, proc) defineprimproc(&env, MAKE_CONSTANT_SYMBOL(#name), proc)
+
+/* Global environments
+
+   A global environment maps each symbol bound in it to a binding, a pair
+   of the symbol and its value, through an open-addressed hash table
+   keyed on the hash of the symbol's name. The table is a separate object
+   so that it can be replaced when it grows. */
+
+#define INITIAL_ENV_SIZE 256
+
+Obj *maketable(long size)
+{
+  Obj *table = allocbytes(sizeof(Obj) + size * sizeof(Obj *));
+  table->type = TABLE;
+  table->data.table.size = size;
+  return table;
+}
+
+Obj *makeglobalenv()
+{
+  Obj *table = maketable(INITIAL_ENV_SIZE);
+  PROTECT(table);
+  Obj *env = allocobj();
+  UNPROTECT(1);
+  env->type = ENVIRONMENT;
+  env->data.environment.table = table;
+  env->data.environment.count = 0;
+  return env;
+}
+
+/* the slot holding sym's binding in env, which is NULL if it is unbound */
+Obj **envslot(Obj *sym, Obj *env)
+{
+  Obj *table = env->data.environment.table;
+  long mask = table->data.table.size - 1;
+  for (long i = sym->data.symbol.hash & mask;; i = (i + 1) & mask) {
+    Obj *binding = TABLESLOTS(table)[i];
+    if (binding == NULL || car(binding) == sym)
+      return &TABLESLOTS(table)[i];
+  }
+}
+
+void growenv(Obj *env)
+{
+  PROTECT(env);
+  Obj *table = maketable(2 * env->data.environment.table->data.table.size);
+  UNPROTECT(1);
+
+  Obj *old = env->data.environment.table;
+  env->data.environment.table = table;
+  for (long i = 0; i < old->data.table.size; ++i) {
+    Obj *binding = TABLESLOTS(old)[i];
+    if (binding != NULL)
+      *envslot(car(binding), env) = binding;
+  }
+}
+
+void define(Obj *sym, Obj *val, Obj *env)
+{
+  Obj **slot = envslot(sym, env);
+  if (*slot != NULL) {
+    setcdr(*slot, val);
+    return;
+  }
+
+  GCSAVE;
+  PROTECT(sym);
+  PROTECT(val);
+  PROTECT(env);
+  if (4 * (env->data.environment.count + 1) > 3 * env->data.environment.table->data.table.size)
+    growenv(env);
+  Obj *binding = cons(sym, val);
+  *envslot(sym, env) = binding;
+  ++env->data.environment.count;
+  GCRESTORE;
+}
+
+void defineprimproc(Obj **env, Obj *sym, Obj *(*proc)(Obj *args))
+{
+  PROTECT(sym);
+  Obj *primproc = makeprimproc(proc);
+  UNPROTECT(1);
+  define(sym, primproc, *env);
+}
 
 Obj *interactionenv;
-Obj *predefinedenv;
 
 Obj *interactionenvproc(Obj *args)
 {
@@ -421,21 +1117,19 @@ Obj *interactionenvproc(Obj *args)
 
 Obj *nullenv(Obj *args)
 {
-  return cons(thenull, thenull);
+  return makeglobalenv();
 }
 
 Obj *initenv();
 
 Obj *makeenv(Obj *args)
 {
-  Obj *env = nullenv(thenull);
-  setcar(env, initenv());
-  return env;
+  return initenv();
 }
 
-Obj *read(FILE *in);
+Obj *read(Reader *in);
 
-#define GET_IN_PORT(args) isnull(args) ? stdin : car(args)->data.inputport.in
+#define GET_IN_PORT(args) isnull(args) ? stdinreader : car(args)->data.inputport.reader
 
 Obj *readproc(Obj *args)
 {
@@ -445,12 +1139,10 @@ Obj *readproc(Obj *args)
 
 Obj *readcharproc(Obj *args)
 {
-  int c = getc(GET_IN_PORT(args));
+  int c = nextchar(GET_IN_PORT(args));
   return c == EOF ? theeof : makechar(c);
 }
 
-int peek(FILE *in);
-
 Obj *peekcharproc(Obj *args)
 {
   int c = peek(GET_IN_PORT(args));
@@ -459,12 +1151,12 @@ Obj *peekcharproc(Obj *args)
 
 Obj *openinputfile(Obj *args)
 {
-  return makeinputport(fopen(car(args)->data.string.val, "r"));
+  return makeinputport(openreader(car(args)->data.string.val));
 }
 
-void write(FILE *out, Obj *o);
+void write(Writer *out, Obj *o);
 
-#define GET_OUT_PORT(args) isnull(args) ? stdout : car(args)->data.outputport.out
+#define GET_OUT_PORT(args) isnull(args) ? stdoutwriter : car(args)->data.outputport.writer
 
 Obj *writeproc(Obj *args)
 {
@@ -474,48 +1166,59 @@ Obj *writeproc(Obj *args)
 
 Obj *writecharproc(Obj *args)
 {
-  putc(car(args)->data._char.val, GET_OUT_PORT(cdr(args)));
+  wputc(GET_OUT_PORT(cdr(args)), CHARVAL(car(args)));
+  return theok;
+}
+
+Obj *flushoutput(Obj *args)
+{
+  flushwriter(GET_OUT_PORT(args));
   return theok;
 }
 
 Obj *openoutputfile(Obj *args)
 {
-  return makeoutputport(fopen(car(args)->data.string.val, "w"));
+  FILE *file = fopen(car(args)->data.string.val, "w");
+  if (file == NULL)
+    ERROR("could not open %s\n", car(args)->data.string.val);
+  return makeoutputport(makewriter(file));
 }
 
 Obj *closeport(Obj *args)
 {
-  fclose(car(args)->data.inputport.in); /* union hacking */
+  if (gettype(car(args)) == INPUT_PORT)
+    closereader(car(args)->data.inputport.reader);
+  else
+    closewriter(car(args)->data.outputport.writer);
   return theok;
 }
 
-void display(FILE* out, Obj *args);
+void display(Writer *out, Obj *args);
 
 /* TODO: make writepair accept a function pointer */
-void displaypair(FILE *out, Obj *o)
+void displaypair(Writer *out, Obj *o)
 {
   display(out, car(o));
-
-  if (isnull(cdr(o)));
-  else if (cdr(o)->type == PAIR) {
-    fprintf(out, " ");
-    displaypair(out, cdr(o));
-  } else {
-    fprintf(out, " . ");
-    display(out, cdr(o));
+  for (o = cdr(o); gettype(o) == PAIR; o = cdr(o)) {
+    wputc(out, ' ');
+    display(out, car(o));
+  }
+  if (!isnull(o)) {
+    wputs(out, " . ");
+    display(out, o);
   }
 }
 
-void display(FILE *out, Obj *o)
+void display(Writer *out, Obj *o)
 {
-  switch (o->type) {
+  switch (gettype(o)) {
   case STRING:
-    fprintf(out, "%s", o->data.string.val);
+    wputs(out, o->data.string.val);
     break;
   case PAIR:
-    fprintf(out, "(");
+    wputs(out, "(");
     displaypair(out, o);
-    fprintf(out, ")");
+    wputs(out, ")");
     break;
   default:
     write(out, o);
@@ -531,30 +1234,34 @@ Obj *displayproc(Obj *args)
 Obj *error(Obj *args)
 {
   for (Obj *o = args; !isnull(o); o = cdr(o)) {
-    switch (car(o)->type) {
+    if (o != args)
+      wputc(stderrwriter, ' ');
+    switch (gettype(car(o))) {
     case STRING:
-      fprintf(stderr, "%s", car(o)->data.string.val);
+      wputs(stderrwriter, car(o)->data.string.val);
       break;
     default:
-      write(stderr, car(o));
+      write(stderrwriter, car(o));
     }
-    putc(' ', stderr);
   }
-  ungetc(' ', stderr);
   ERROR("\n");
 }
 
 
 Obj *eval(Obj *o, Obj *env);
+Obj *exec(Obj *n, Obj *env);
 
 Obj *load(Obj *args)
 {
-  FILE *in = fopen(car(args)->data.string.val, "r");
+  Reader *in = openreader(car(args)->data.string.val);
   Obj *o;
-  Obj *res;
+  Obj *res = theok;
+  PROTECT(res);
   while ((o = read(in)) != NULL)
     res = eval(o, interactionenv);
-  fclose(in);
+  UNPROTECT(1);
+  closereader(in);
+  free(in);
   return res;
 }
 
@@ -565,8 +1272,16 @@ Obj *eofobject(Obj *args)
 
 Obj *initenv()
 {
-  Obj *env = thenull;
+  Obj *env = makeglobalenv();
+  PROTECT(env);
 
+  /* A primitive is passed its arguments as a list. Under --vm the list
+     is built from pairs on the C stack (see vmcallprim), so a primitive
+     may read the values in it, even after allocating, and may return the
+     list or a tail of it, but must not store the list or any of its
+     pairs in another object. The collector aborts with "stale pointer"
+     if it finds one of those pairs in the heap, which make gc-stress
+     BOOTSTRAP_FLAGS=--vm checks for. */
   MAKE_PRIM_PROC(env, number?, numberp);
   MAKE_PRIM_PROC(env, boolean?, booleanp);
   MAKE_PRIM_PROC(env, char?, charp);
@@ -579,7 +1294,9 @@ Obj *initenv()
   MAKE_PRIM_PROC(env, input-port?, inputportp);
   MAKE_PRIM_PROC(env, output-port?, outputportp);
 
+  MAKE_PRIM_PROC(env, char->integer, chartointeger);
   MAKE_PRIM_PROC(env, number->string, numbertostring);
+  MAKE_PRIM_PROC(env, string->number, stringtonumber);
   MAKE_PRIM_PROC(env, string->symbol, stringtosymbol);
   MAKE_PRIM_PROC(env, symbol->string, symboltostring);
 
@@ -625,6 +1342,7 @@ Obj *initenv()
 
   MAKE_PRIM_PROC(env, write, writeproc);
   MAKE_PRIM_PROC(env, write-char, writecharproc);
+  MAKE_PRIM_PROC(env, flush-output, flushoutput);
   MAKE_PRIM_PROC(env, open-output-file, openoutputfile);
 
   MAKE_PRIM_PROC(env, close-port, closeport);
@@ -634,11 +1352,30 @@ Obj *initenv()
 
   MAKE_PRIM_PROC(env, eof-object, eofobject);
 
+  UNPROTECT(1);
   return env;
 }
 
+Obj **globalroots[] = {
+  &thenull, &thetrue, &thefalse, &theeof,
+  &thequote, &thedefine, &theok, &theset, &theif, &thelambda, &thebegin,
+  &thecond, &theelse, &thelet, &theand, &theor, &theapply, &theeval,
+  &interactionenv,
+  NULL
+};
+
+void initports()
+{
+  stdinreader = makereader(stdin);
+  stdoutwriter = makewriter(stdout);
+  stderrwriter = makewriter(stderr);
+  atexit(flushwriters);
+}
+
 void init()
 {
+  initgc();
+
   thenull = allocobj();
   thenull->type = _NULL;
 
@@ -647,8 +1384,9 @@ void init()
 
   theeof = makeeof();
 
-  interned = thenull;
-  predefinedenv = thenull;
+  symtabsize = INITIAL_SYMTAB_SIZE;
+  symtab = calloc(symtabsize, sizeof(Obj *));
+  interactionenv = thenull;
 
   INIT_CONSTANT_SYMBOL(quote);
   INIT_CONSTANT_SYMBOL(define);
@@ -666,105 +1404,208 @@ void init()
   INIT_CONSTANT_SYMBOL(apply);
   INIT_CONSTANT_SYMBOL(eval);
 
-  predefinedenv = initenv();
+  interactionenv = initenv();
+  initports();
 }
 
-int peek(FILE *in)
+int iswhitespace(int c)
 {
-  int c = getc(in);
-  ungetc(c, in);
-  return c;
+  return c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == '\f' || c == '\v';
 }
 
 int isdelimiter(int c)
 {
-  return isspace(c) || c == '(' || c == ')';
+  return iswhitespace(c) || c == '(' || c == ')' || c == EOF;
 }
 
-void skipwhitespace(FILE *in)
+void skipwhitespace(Reader *in)
 {
   int c;
-  while ((c = getc(in)) != EOF) {
-    if (isspace(c))
+  while ((c = peek(in)) != EOF) {
+    if (iswhitespace(c)) {
+      ++in->pos;
       continue;
+    }
     if (c == ';') {
-      while ((c = getc(in)) != '\n');
+      char *nl = memchr(in->pos, '\n', in->end - in->pos);
+      in->pos = nl == NULL ? in->end : nl + 1;
       continue;
     }
-    ungetc(c, in);
     break;
   }
 }
 
-Obj *readpair(FILE *in)
+Obj *readpair(Reader *in)
 {
-  skipwhitespace(in);
-  if (peek(in) == ')') {
-    getc(in);
-    return thenull;
-  }
-
-  Obj *pair = allocobj();
-  pair->type = PAIR;
-  setcar(pair, read(in));
+  Obj *head = thenull;
+  Obj *tail = thenull;
+  Obj *o;
+  PROTECT(head);
+  PROTECT(tail);
 
-  skipwhitespace(in);
-  if (peek(in) == '.') {
-    getc(in);
-    setcdr(pair, read(in));
+  while (1) {
     skipwhitespace(in);
-    if (getc(in) != ')')
-      ERROR("invalid use of .\n");
-  } else
-    setcdr(pair, readpair(in));
-  return pair;
+    if (peek(in) == ')') {
+      nextchar(in);
+      break;
+    }
+    if (peek(in) == EOF)
+      ERROR("unexpected end of file in list\n");
+    if (!isnull(head) && peek(in) == '.' && in->pos + 1 < in->end &&
+	isdelimiter((unsigned char)in->pos[1])) {
+      nextchar(in);
+      o = read(in);
+      setcdr(tail, o);
+      skipwhitespace(in);
+      if (nextchar(in) != ')')
+	ERROR("invalid use of .\n");
+      break;
+    }
+
+    o = read(in);
+    o = cons(o, thenull);
+    if (isnull(head))
+      head = o;
+    else
+      setcdr(tail, o);
+    tail = o;
+  }
+
+  UNPROTECT(2);
+  return head;
 }
 
-void eat(FILE *in, char *str)
+void eat(Reader *in, char *str)
 {
   for (int i = 0; str[i] != '\0'; ++i)
-    if (getc(in) != str[i])
+    if (nextchar(in) != str[i])
       ERROR("unexpected character\n");
 }
 
-void assertnextdelim(FILE *in)
+void assertnextdelim(Reader *in)
 {
   if (!isdelimiter(peek(in)))
     ERROR("expected delimiter\n");
 }
 
-Obj *read(FILE *in)
-{
-#define BUFFER_LEN 1024
-  char readbuffer[BUFFER_LEN];
-  int i = 0;
-  long l;
-
-  skipwhitespace(in);
-
-  int c = getc(in);
+/* Strings and symbols which span a refill, or strings with escapes, are
+   collected here; it grows as needed so tokens have no length limit */
+char *tokbuf;
+size_t toklen;
+size_t tokcap;
 
-  if (c == EOF) {
-    ungetc(' ', in); /* hack to remove EOF */
-    return NULL;
-  } else if (isdigit(c) || (c == '-' && isdigit(peek(in)))) {
-    ungetc(c, in);
-    fscanf(in, "%ld", &l);
-    return makefixnum(l);
-  } else if (c == '(')
-    return readpair(in);
-  else if (c == ')') {
-    ERROR("unbalanced parenthesis\n");
-  } else if (c == '\'') {
-    return cons(thequote, cons(read(in), thenull));
-  } else if (c == '#') {
-    switch (getc(in)) {
+void tokappend(char *s, size_t n)
+{
+  if (toklen + n + 1 > tokcap) {
+    while (toklen + n + 1 > tokcap)
+      tokcap = tokcap == 0 ? 1024 : 2 * tokcap;
+    tokbuf = realloc(tokbuf, tokcap);
+  }
+  memcpy(tokbuf + toklen, s, n);
+  toklen += n;
+}
+
+Obj *readstring(Reader *in)
+{
+  toklen = 0;
+  while (1) {
+    char *start = in->pos;
+    char *p = start;
+    while (p < in->end && *p != '"' && *p != '\\')
+      ++p;
+    in->pos = p;
+    if (p < in->end && *p == '"' && toklen == 0) {
+      ++in->pos;
+      return makestring(start, p - start + 1);
+    }
+    tokappend(start, p - start);
+    if (p == in->end) {
+      if (!fillreader(in))
+	ERROR("unexpected end of file in string\n");
+      continue;
+    }
+    switch (nextchar(in)) {
+    case '"':
+      return makestring(tokbuf, toklen + 1);
+    case '\\':
+      switch (nextchar(in)) {
+      case 'n':
+	tokappend("\n", 1);
+	break;
+      case '"':
+	tokappend("\"", 1);
+	break;
+      case '\\':
+	tokappend("\\", 1);
+	break;
+      default:
+	ERROR("unrecognized escape sequence\n");
+      }
+      break;
+    }
+  }
+}
+
+Obj *readsymbol(Reader *in)
+{
+  toklen = 0;
+  while (1) {
+    char *start = in->pos;
+    char *p = start;
+    while (p < in->end && !isdelimiter((unsigned char)*p))
+      ++p;
+    in->pos = p;
+    if (p < in->end && toklen == 0)
+      return makesymbol(start, p - start + 1);
+    tokappend(start, p - start);
+    if (p < in->end || !fillreader(in))
+      return makesymbol(tokbuf, toklen + 1);
+  }
+}
+
+Obj *readfixnum(Reader *in)
+{
+  int negative = peek(in) == '-';
+  if (negative)
+    ++in->pos;
+  long l = 0;
+  int c;
+  while ((c = peek(in)) >= '0' && c <= '9') {
+    l = 10 * l + (c - '0');
+    ++in->pos;
+  }
+  return makefixnum(negative ? -l : l);
+}
+
+Obj *read(Reader *in)
+{
+  skipwhitespace(in);
+
+  int c = peek(in);
+
+  if (c == EOF)
+    return NULL;
+  else if ((c >= '0' && c <= '9') ||
+	   (c == '-' && in->pos + 1 < in->end && in->pos[1] >= '0' && in->pos[1] <= '9'))
+    return readfixnum(in);
+
+  ++in->pos;
+  if (c == '(')
+    return readpair(in);
+  else if (c == ')') {
+    ERROR("unbalanced parenthesis\n");
+  } else if (c == '\'') {
+    Obj *quoted = read(in);
+    quoted = cons(quoted, thenull);
+    return cons(thequote, quoted);
+  } else if (c == '#') {
+    switch (nextchar(in)) {
     case 't':
       return thetrue;
     case 'f':
       return thefalse;
     case '\\':
-      c = getc(in);
+      c = nextchar(in);
       switch(c) {
       case 's':
 	if (peek(in) == 'p') {
@@ -784,353 +1625,1650 @@ Obj *read(FILE *in)
     default:
       ERROR("# not followed by t, f, or \\\n");
     }
-  } else if (c == '"') {
-    while ((c = getc(in)) != '"') {
-      if (c == '\\')
-	switch (getc(in)) {
-	case 'n':
-	  readbuffer[i++] = '\n';
-	  break;
-	case '"':
-	  readbuffer[i++] = '"';
-	  break;
-	case '\\':
-	  readbuffer[i++] = '\\';
-	  break;
-	default:
-	  ERROR("unrecognized escape sequence\n");
-	}
-      else
-	readbuffer[i++] = c;
-    }
-    readbuffer[i++] = '\0';
-    return makestring(readbuffer, i);
-  }
+  } else if (c == '"')
+    return readstring(in);
 
-  ungetc(c, in);
-  for (; !isdelimiter(c = getc(in)); readbuffer[i++] = c);
-  ungetc(c, in);
-  readbuffer[i++] = '\0';
-  return makesymbol(readbuffer, i);
+  --in->pos;
+  return readsymbol(in);
 }
 
-Obj *makealist(Obj *a, Obj *b)
+Obj *envlookup(Obj *sym, Obj *env)
 {
-  if (isnull(a))
-    return thenull;
-  return cons(cons(car(a), car(b)), makealist(cdr(a), cdr(b)));
+  Obj *binding = *envslot(sym, env);
+  if (binding != NULL)
+    return binding;
+  fprintf(stderr, "unbound variable: ");
+  write(stderrwriter, sym);
+  ERROR("\n");
 }
 
-Obj *bindformals(Obj *formals, Obj *args)
+/* arguments are evaluated left to right */
+Obj *execall(Obj *list, Obj *env)
 {
-  if (formals->type == PAIR)
-    return makealist(formals, args);
-  return cons(cons(formals, args), thenull);
+  Obj *head = thenull;
+  Obj *tail = thenull;
+  Obj *o;
+  GCSAVE;
+  PROTECT(list);
+  PROTECT(env);
+  PROTECT(head);
+  PROTECT(tail);
+
+  for (; !isnull(list); list = cdr(list)) {
+    o = exec(car(list), env);
+    o = cons(o, thenull);
+    if (isnull(head))
+      head = o;
+    else
+      setcdr(tail, o);
+    tail = o;
+  }
+
+  GCRETURN(head);
 }
 
-Obj *framelookup(Obj *sym, Obj *frame)
+Obj *condtoif(Obj *condforms)
 {
-  for (Obj *o = frame; !isnull(o); o = cdr(o))
-    if (caar(o) == sym)
-      return car(o);
+  if (isnull(condforms))
+    return thefalse;
+  if (iselse(caar(condforms)))
+    return cons(thebegin, cdar(condforms));
+
+  Obj *alternative = thenull;
+  Obj *consequent = thenull;
+  GCSAVE;
+  PROTECT(condforms);
+  PROTECT(alternative);
+  PROTECT(consequent);
 
-  return thenull;
+  alternative = condtoif(cdr(condforms));
+  alternative = cons(alternative, thenull);
+  consequent = cons(thebegin, cdar(condforms));
+  alternative = cons(consequent, alternative);
+  alternative = cons(caar(condforms), alternative);
+  GCRETURN(cons(theif, alternative));
 }
 
-Obj *envlookup(Obj *sym, Obj *env)
+/* the bindings keep their order, so that the values are evaluated left
+   to right as they are in compiled code */
+Obj *lettolambda(Obj *letforms)
 {
-  for (Obj *o = env; !isnull(o); o = cdr(o)) {
-    Obj *binding = framelookup(sym, car(o));
-    if (!isnull(binding))
-      return binding;
+  Obj *formals = thenull;
+  Obj *values = thenull;
+  Obj *formalstail = thenull;
+  Obj *valuestail = thenull;
+  Obj *o;
+  GCSAVE;
+  PROTECT(letforms);
+  PROTECT(formals);
+  PROTECT(values);
+  PROTECT(formalstail);
+  PROTECT(valuestail);
+
+  for (Obj *b = car(letforms); !isnull(b); b = cdr(b)) {
+    PROTECT(b);
+    o = cons(caar(b), thenull);
+    if (isnull(formals))
+      formals = o;
+    else
+      setcdr(formalstail, o);
+    formalstail = o;
+    o = cons(cadar(b), thenull);
+    if (isnull(values))
+      values = o;
+    else
+      setcdr(valuestail, o);
+    valuestail = o;
+    UNPROTECT(1);
   }
-  fprintf(stderr, "unbound variable: ");
-  write(stderr, sym);
-  ERROR("\n");
+  formals = cons(formals, cdr(letforms));
+  formals = cons(thelambda, formals);
+  GCRETURN(cons(formals, values));
+}
+
+/* Analysis
+
+   Before an expression is evaluated it is analyzed once into a tree of
+   nodes, with special forms recognized and derived forms desugared, so
+   that exec need not re-examine the syntax each time the code runs.
+
+   Local variables are resolved during analysis to a depth and an index:
+   each procedure call gets a FRAME whose slots hold the procedure's
+   parameters followed by the variables defined at the top of its body,
+   and depth counts the frames to walk up through. Variables not bound
+   by an enclosing lambda are global and looked up by name in the
+   environment below the outermost frame. The analysis scope is a list
+   with a list of variables for each enclosing lambda.
+
+   A node's fields are:
+
+   CONST_NODE       a: the value
+   LOCAL_REF_NODE   a: depth, b: index, c: the variable
+   GLOBAL_REF_NODE  a: the variable, b: depth of the global environment,
+                    c: its binding, once it has been looked up
+   LOCAL_SET_NODE   a: depth, b: index, c: the value
+   GLOBAL_SET_NODE  a: the variable, b: the value, c: depth of the global environment
+   DEFINE_NODE      a: the variable, b: the value
+   IF_NODE          a: test, b: consequent, c: alternative
+   LAMBDA_NODE      a: arity, b: body, c: frame size
+   SEQ_NODE         a: list of expressions
+   AND_NODE         a: list of expressions
+   OR_NODE          a: list of expressions
+   APPLY_NODE       a: procedure, b: list of arguments
+   EVAL_NODE        a: expression, b: environment
+   CALL_NODE        a: procedure, b: list of arguments
+
+   Depths, indices, arities and sizes are fixnums. The arity of a lambda
+   with a rest parameter and n required ones is -(n + 1). */
+
+Obj *makenode(Type type, Obj *a, Obj *b, Obj *c)
+{
+  PROTECT(a);
+  PROTECT(b);
+  PROTECT(c);
+  Obj *node = allocobj();
+  UNPROTECT(3);
+  node->type = type;
+  node->data.node.a = a;
+  node->data.node.b = b;
+  node->data.node.c = c;
+  return node;
+}
+
+int scopelookup(Obj *sym, Obj *scope, long *depth, long *index)
+{
+  *depth = 0;
+  for (Obj *f = scope; !isnull(f); f = cdr(f), ++*depth) {
+    *index = 0;
+    for (Obj *v = car(f); !isnull(v); v = cdr(v), ++*index)
+      if (car(v) == sym)
+	return 1;
+  }
+  return 0;
 }
 
-void define(Obj *sym, Obj *val, Obj *env)
+/* add sym to the end of the list of variables vars unless it is there */
+Obj *addvar(Obj *vars, Obj *sym)
 {
-  for (Obj *o = env; !isnull(o); o = cdr(o)) {
-    Obj *binding = framelookup(sym, car(o));
-    if (!isnull(binding)) {
-      setcdr(binding, val);
-      return;
-    }
-  }
-  if (isnull(car(env)))
-    setcar(env, cons(cons(sym, val), thenull));
-  else {
-    Obj *o;
-    for (o = car(env); !isnull(cdr(o)); o = cdr(o));
-    setcdr(o, cons(cons(sym, val), thenull));
+  Obj *o;
+  for (o = vars; !isnull(o); o = cdr(o))
+    if (car(o) == sym)
+      return vars;
+  PROTECT(vars);
+  o = cons(sym, thenull);
+  UNPROTECT(1);
+  if (isnull(vars))
+    return o;
+  Obj *tail;
+  for (tail = vars; !isnull(cdr(tail)); tail = cdr(tail));
+  setcdr(tail, o);
+  return vars;
+}
+
+/* add the variables defined at the top of body to vars */
+Obj *bodydefines(Obj *vars, Obj *body)
+{
+  GCSAVE;
+  PROTECT(vars);
+  PROTECT(body);
+  for (; !isnull(body); body = cdr(body)) {
+    Obj *o = car(body);
+    if (gettype(o) != PAIR)
+      continue;
+    if (isdefine(car(o)))
+      vars = addvar(vars, gettype(cadr(o)) == PAIR ? caadr(o) : cadr(o));
+    else if (isbegin(car(o)))
+      vars = bodydefines(vars, cdr(o));
   }
+  GCRETURN(vars);
 }
 
-Obj *evalall(Obj *list, Obj *env)
+Obj *analyze(Obj *o, Obj *scope);
+
+Obj *analyzeall(Obj *list, Obj *scope)
 {
-  if (isnull(list))
-    return thenull;
-  return cons(eval(car(list), env), evalall(cdr(list), env));
+  Obj *head = thenull;
+  Obj *tail = thenull;
+  Obj *o;
+  GCSAVE;
+  PROTECT(list);
+  PROTECT(scope);
+  PROTECT(head);
+  PROTECT(tail);
+
+  for (; !isnull(list); list = cdr(list)) {
+    o = analyze(car(list), scope);
+    o = cons(o, thenull);
+    if (isnull(head))
+      head = o;
+    else
+      setcdr(tail, o);
+    tail = o;
+  }
+
+  GCRETURN(head);
 }
 
-Obj *condtoif(Obj *condforms)
+Obj *analyzebody(Obj *body, Obj *scope)
 {
-  if (isnull(condforms))
-    return thefalse;
-  if (iselse(caar(condforms)))
-    return cons(thebegin, cdar(condforms));
-  return cons(theif,
-	      cons(caar(condforms),
-		   cons(cons(thebegin, cdar(condforms)),
-			cons(condtoif(cdr(condforms)), thenull))));
+  if (!isnull(body) && isnull(cdr(body)))
+    return analyze(car(body), scope);
+  Obj *list = analyzeall(body, scope);
+  return makenode(SEQ_NODE, list, NULL, NULL);
 }
 
-Obj *lettolambda(Obj *letforms)
+Obj *analyzelambda(Obj *formals, Obj *body, Obj *scope)
 {
-  Obj *formals = thenull;
-  Obj *values = thenull;
-  for (Obj *o = car(letforms); !isnull(o); o = cdr(o)) {
-    PUSH(caar(o), formals);
-    PUSH(cadar(o), values);
+  Obj *vars = thenull;
+  long nrequired = 0;
+  int rest = 0;
+  GCSAVE;
+  PROTECT(formals);
+  PROTECT(body);
+  PROTECT(scope);
+  PROTECT(vars);
+
+  for (; gettype(formals) == PAIR; formals = cdr(formals), ++nrequired)
+    vars = addvar(vars, car(formals));
+  if (!isnull(formals)) {
+    vars = addvar(vars, formals);
+    rest = 1;
   }
-  return cons(cons(thelambda, cons(formals, cdr(letforms))), values);
+  vars = bodydefines(vars, body);
+
+  scope = cons(vars, scope);
+  body = analyzebody(body, scope);
+  GCRETURN(makenode(LAMBDA_NODE,
+		    makefixnum(rest ? -(nrequired + 1) : nrequired),
+		    body,
+		    makefixnum(length(vars))));
 }
 
-#define ISTRUTHY !isfalse
+Obj *analyzeset(Obj *sym, Obj *value, Obj *scope)
+{
+  long depth, index;
+  if (scopelookup(sym, scope, &depth, &index))
+    return makenode(LOCAL_SET_NODE, makefixnum(depth), makefixnum(index), value);
+  return makenode(GLOBAL_SET_NODE, sym, value, makefixnum(length(scope)));
+}
 
-Obj *eval(Obj *o, Obj *env)
+Obj *analyze(Obj *o, Obj *scope)
 {
-  Obj *args;
- tailcall:
-  switch (o->type) {
+  Obj *a = NULL;
+  Obj *b = NULL;
+  Obj *c = NULL;
+  long depth, index;
+  GCSAVE;
+  PROTECT(o);
+  PROTECT(scope);
+  PROTECT(a);
+  PROTECT(b);
+  PROTECT(c);
+
+  switch (gettype(o)) {
   case NUMBER:
   case BOOLEAN:
   case CHAR:
   case STRING:
   case _EOF:
   case INPUT_PORT:
-    return o;
+    GCRETURN(makenode(CONST_NODE, o, NULL, NULL));
   case SYMBOL:
-    return cdr(envlookup(o, env));
+    if (scopelookup(o, scope, &depth, &index))
+      GCRETURN(makenode(LOCAL_REF_NODE, makefixnum(depth), makefixnum(index), o));
+    GCRETURN(makenode(GLOBAL_REF_NODE, o, makefixnum(length(scope)), NULL));
   case PAIR:
     if (isquote(car(o)))
-      return cadr(o);
+      GCRETURN(makenode(CONST_NODE, cadr(o), NULL, NULL));
     if (isdefine(car(o))) {
-      if (cadr(o)->type == PAIR)
-	define(caadr(o), eval(cons(thelambda, cons(cdadr(o), cddr(o))), env), env);
-      else
-	define(cadr(o), eval(caddr(o), env), env);
-      return theok;
+      if (gettype(cadr(o)) == PAIR) {
+	a = caadr(o);
+	b = analyzelambda(cdadr(o), cddr(o), scope);
+      } else {
+	a = cadr(o);
+	b = analyze(caddr(o), scope);
+      }
+      if (isnull(scope))
+	GCRETURN(makenode(DEFINE_NODE, a, b, NULL));
+      if (!scopelookup(a, scope, &depth, &index) || depth != 0) {
+	fprintf(stderr, "define not at the start of a body: ");
+	write(stderrwriter, a);
+	ERROR("\n");
+      }
+      GCRETURN(analyzeset(a, b, scope));
     }
     if (isset(car(o))) {
-      Obj *pair = envlookup(cadr(o), env);
-      setcdr(pair, eval(caddr(o), env));
-      return theok;
+      b = analyze(caddr(o), scope);
+      GCRETURN(analyzeset(cadr(o), b, scope));
     }
     if (isif(car(o))) {
-      o = ISTRUTHY(eval(cadr(o), env)) ? caddr(o) : (isnull(cdddr(o)) ? thefalse : cadddr(o));
-      goto tailcall;
+      a = analyze(cadr(o), scope);
+      b = analyze(caddr(o), scope);
+      if (isnull(cdddr(o)))
+	c = makenode(CONST_NODE, thefalse, NULL, NULL);
+      else
+	c = analyze(cadddr(o), scope);
+      GCRETURN(makenode(IF_NODE, a, b, c));
     }
     if (islambda(car(o)))
-      return makecompproc(cadr(o), cddr(o), env);
-    if (isbegin(car(o))) {
-      for (o = cdr(o); !isnull(cdr(o)); o = cdr(o))
-	eval(car(o), env);
-      o = car(o);
-      goto tailcall;
-    }
+      GCRETURN(analyzelambda(cadr(o), cddr(o), scope));
+    if (isbegin(car(o)))
+      GCRETURN(analyzebody(cdr(o), scope));
     if (iscond(car(o))) {
-      o = condtoif(cdr(o));
-      goto tailcall;
+      a = condtoif(cdr(o));
+      GCRETURN(analyze(a, scope));
     }
     if (islet(car(o))) {
-      o = lettolambda(cdr(o));
-      goto tailcall;
+      a = lettolambda(cdr(o));
+      GCRETURN(analyze(a, scope));
     }
     if (isand(car(o))) {
       if (isnull(cdr(o)))
-	return thetrue;
-      for (o = cdr(o); !isnull(cdr(o)); o = cdr(o))
-	if (isfalse(eval(car(o), env)))
-	  return thefalse;
-      o = car(o);
-      goto tailcall;
+	GCRETURN(makenode(CONST_NODE, thetrue, NULL, NULL));
+      a = analyzeall(cdr(o), scope);
+      GCRETURN(makenode(AND_NODE, a, NULL, NULL));
     }
     if (isor(car(o))) {
       if (isnull(cdr(o)))
-	return thefalse;
-      for (o = cdr(o); !isnull(cdr(o)); o = cdr(o)) {
-	Obj *r = eval(car(o), env);
-	if (ISTRUTHY(r))
-	  return r;
-      }
-      o = car(o);
-      goto tailcall;
+	GCRETURN(makenode(CONST_NODE, thefalse, NULL, NULL));
+      a = analyzeall(cdr(o), scope);
+      GCRETURN(makenode(OR_NODE, a, NULL, NULL));
     }
     if (isapply(car(o))) {
-      Obj *evaled = evalall(cddr(o), env);
-
-      if (isnull(evaled));
-      else if (isnull(cdr(evaled)))
-	evaled = car(evaled);
-      else {
-	Obj *e;
-	for (e = evaled; !isnull(cddr(e)); e = cdr(e));
-	setcdr(e, cadr(e));
-      }
-
-      o = cons(cadr(o), thenull);
-      args = evaled;
-      goto apply;
+      a = analyze(cadr(o), scope);
+      b = analyzeall(cddr(o), scope);
+      GCRETURN(makenode(APPLY_NODE, a, b, NULL));
     }
     if (iseval(car(o))) {
-      Obj *newo = eval(cadr(o), env);
-      env = eval(caddr(o), env);
-      o = newo;
+      a = analyze(cadr(o), scope);
+      b = analyze(caddr(o), scope);
+      GCRETURN(makenode(EVAL_NODE, a, b, NULL));
+    }
+    a = analyze(car(o), scope);
+    b = analyzeall(cdr(o), scope);
+    GCRETURN(makenode(CALL_NODE, a, b, NULL));
+  default:
+    fprintf(stderr, "cannot eval object: ");
+    write(stderrwriter, o);
+    ERROR("\n");
+  }
+}
+
+/* Execution */
+
+Obj *frameup(Obj *env, long depth)
+{
+  for (; depth > 0; --depth)
+    env = env->data.frame.parent;
+  return env;
+}
+
+/* A compound procedure's lambda is its LAMBDA_NODE, or its CODE object
+   when it was compiled for the VM. */
+
+long procarity(Obj *proc)
+{
+  Obj *lambda = proc->data.compproc.lambda;
+  return lambda->type == CODE ? lambda->data.code.arity : numval(lambda->data.node.a);
+}
+
+long procframesize(Obj *proc)
+{
+  Obj *lambda = proc->data.compproc.lambda;
+  return lambda->type == CODE ? lambda->data.code.framesize : numval(lambda->data.node.c);
+}
+
+/* As they always have, procedures ignore surplus arguments, and
+   parameters without an argument are left unassigned. */
+
+/* A frame for calling proc on the values of argnodes, which are
+   evaluated left to right in env. */
+Obj *callframe(Obj *proc, Obj *argnodes, Obj *env)
+{
+  Obj *frame = thenull;
+  Obj *rest = thenull;
+  Obj *tail = thenull;
+  Obj *o;
+  GCSAVE;
+  PROTECT(proc);
+  PROTECT(argnodes);
+  PROTECT(env);
+  PROTECT(frame);
+  PROTECT(rest);
+  PROTECT(tail);
+
+  long arity = procarity(proc);
+  long nrequired = arity >= 0 ? arity : -arity - 1;
+  long size = procframesize(proc);
+  frame = makeframe(size, proc->data.compproc.env);
+
+  for (long i = 0; !isnull(argnodes); ++i, argnodes = cdr(argnodes)) {
+    o = exec(car(argnodes), env);
+    if (i < nrequired)
+      FRAMESLOTS(frame)[i] = o;
+    else if (arity < 0) {
+      o = cons(o, thenull);
+      if (isnull(rest))
+	rest = o;
+      else
+	setcdr(tail, o);
+      tail = o;
+    }
+  }
+  if (arity < 0)
+    FRAMESLOTS(frame)[nrequired] = rest;
+
+  GCRETURN(frame);
+}
+
+/* A frame for calling proc on the list of values args. */
+Obj *bindframe(Obj *proc, Obj *args)
+{
+  long arity = procarity(proc);
+  long nrequired = arity >= 0 ? arity : -arity - 1;
+  long size = procframesize(proc);
+  PROTECT(args);
+  Obj *frame = makeframe(size, proc->data.compproc.env);
+  UNPROTECT(1);
+
+  long i;
+  for (i = 0; i < nrequired && !isnull(args); ++i, args = cdr(args))
+    FRAMESLOTS(frame)[i] = car(args);
+  if (arity < 0)
+    FRAMESLOTS(frame)[nrequired] = i == nrequired ? args : thenull;
+  return frame;
+}
+
+#define ISTRUTHY !isfalse
+
+Obj *exec(Obj *n, Obj *env)
+{
+  Obj *args = thenull;
+  Obj *proc = thenull;
+  Obj *o;
+  GCSAVE;
+  PROTECT(n);
+  PROTECT(env);
+  PROTECT(args);
+  PROTECT(proc);
+ tailcall:
+  switch (n->type) {
+  case CONST_NODE:
+    GCRETURN(n->data.node.a);
+  case LOCAL_REF_NODE:
+    o = FRAMESLOTS(frameup(env, numval(n->data.node.a)))[numval(n->data.node.b)];
+    if (o == NULL) {
+      fprintf(stderr, "unassigned variable: ");
+      write(stderrwriter, n->data.node.c);
+      ERROR("\n");
+    }
+    GCRETURN(o);
+  case GLOBAL_REF_NODE:
+    /* bindings are never removed, and code is only ever run in the
+       global environment it was analyzed for, so the binding can be
+       kept in the node */
+    if (n->data.node.c == NULL)
+      n->data.node.c = envlookup(n->data.node.a, frameup(env, numval(n->data.node.b)));
+    GCRETURN(cdr(n->data.node.c));
+  case LOCAL_SET_NODE:
+    o = exec(n->data.node.c, env);
+    FRAMESLOTS(frameup(env, numval(n->data.node.a)))[numval(n->data.node.b)] = o;
+    GCRETURN(theok);
+  case GLOBAL_SET_NODE:
+    proc = exec(n->data.node.b, env);
+    setcdr(envlookup(n->data.node.a, frameup(env, numval(n->data.node.c))), proc);
+    GCRETURN(theok);
+  case DEFINE_NODE:
+    proc = exec(n->data.node.b, env);
+    define(n->data.node.a, proc, env);
+    GCRETURN(theok);
+  case IF_NODE:
+    n = ISTRUTHY(exec(n->data.node.a, env)) ? n->data.node.b : n->data.node.c;
+    goto tailcall;
+  case LAMBDA_NODE:
+    GCRETURN(makecompproc(n, env));
+  case SEQ_NODE:
+    for (args = n->data.node.a; !isnull(cdr(args)); args = cdr(args))
+      exec(car(args), env);
+    n = car(args);
+    goto tailcall;
+  case AND_NODE:
+    for (args = n->data.node.a; !isnull(cdr(args)); args = cdr(args))
+      if (isfalse(exec(car(args), env)))
+	GCRETURN(thefalse);
+    n = car(args);
+    goto tailcall;
+  case OR_NODE:
+    for (args = n->data.node.a; !isnull(cdr(args)); args = cdr(args)) {
+      Obj *r = exec(car(args), env);
+      if (ISTRUTHY(r))
+	GCRETURN(r);
+    }
+    n = car(args);
+    goto tailcall;
+  case APPLY_NODE:
+    args = execall(n->data.node.b, env);
+
+    if (isnull(args));
+    else if (isnull(cdr(args)))
+      args = car(args);
+    else {
+      Obj *e;
+      for (e = args; !isnull(cddr(e)); e = cdr(e));
+      setcdr(e, cadr(e));
+    }
+
+    proc = exec(n->data.node.a, env);
+    switch (gettype(proc)) {
+    case PRIM_PROC:
+      GCRETURN((*(proc->data.primproc.proc))(args));
+    case COMP_PROC:
+      env = bindframe(proc, args);
+      n = proc->data.compproc.lambda->data.node.b;
       goto tailcall;
+    default:
+      break;
     }
+    break;
+  case EVAL_NODE:
+    proc = exec(n->data.node.a, env);
+    env = exec(n->data.node.b, env);
+    n = analyze(proc, thenull);
+    goto tailcall;
+  case CALL_NODE:
+    proc = exec(n->data.node.a, env);
+    switch (gettype(proc)) {
+    case PRIM_PROC:
+      args = execall(n->data.node.b, env);
+      GCRETURN((*(proc->data.primproc.proc))(args));
+    case COMP_PROC:
+      env = callframe(proc, n->data.node.b, env);
+      n = proc->data.compproc.lambda->data.node.b;
+      goto tailcall;
+    default:
+      break;
+    }
+    break;
+  default:
+    fprintf(stderr, "cannot execute node: ");
+    write(stderrwriter, n);
+    ERROR("\n");
+  }
 
-    args = evalall(cdr(o), env);
-  apply:
-    do {
-      Obj *proc = eval(car(o), env);
-      switch (proc->type) {
-      case PRIM_PROC:
-	return (*(proc->data.primproc.proc))(args);
-      case COMP_PROC:
-	env = cons(bindformals(proc->data.compproc.formals, args), proc->data.compproc.env);
-	for (o = proc->data.compproc.body; !isnull(cdr(o)); o = cdr(o))
-	  eval(car(o), env);
-	o = car(o);
-	goto tailcall;
-      default:
-	fprintf(stderr, "not a procedure: ");
-	write(stderr, proc);
-	ERROR("\n");
-      }
-    } while (0);
+  fprintf(stderr, "not a procedure: ");
+  write(stderrwriter, proc);
+  ERROR("\n");
+}
+
+/* Bytecode
+
+   With --vm, analyzed expressions are compiled to bytecode and run on a
+   stack machine instead of by exec. A CODE object holds the instructions
+   for one lambda body or top-level form, each an opcode followed by its
+   operands, along with a table of the constants they refer to. Local
+   and global variables are addressed as they are by the analyzer, and
+   a call allocates the same FRAME exec would.
+
+   OP_CONST k          push constant k
+   OP_LOCAL0 i k       push slot i of the current frame (k names it)
+   OP_LOCAL d i k      push slot i of the frame d levels up
+   OP_GLOBAL k d       push the value of global k, which is replaced by
+                       its binding once that has been looked up
+   OP_SETLOCAL d i     pop into slot i of the frame d levels up, push ok
+   OP_SETGLOBAL k d    pop into global k, push ok
+   OP_DEFINE k         define global k as the top of the stack, which
+                       becomes ok
+   OP_POP              drop the top of the stack
+   OP_JUMP t           continue at instruction t
+   OP_JUMPF t          pop, continuing at t if it was false
+   OP_ANDJ t           continue at t if the top is false, else pop
+   OP_ORJ t            continue at t if the top is true, else pop
+   OP_CLOSURE k        push a procedure with code k closing over the frame
+   OP_CALL n           call the procedure below the top n values on them
+   OP_TAILCALL n       the same, replacing the current call
+   OP_RETURN           pop and return the top of the stack
+   OP_APPLY n          call the procedure below the top n values on them,
+                       the last of which is a list of further arguments
+   OP_EVAL             pop an environment and an expression and evaluate
+                       the expression in the environment */
+
+enum { OP_CONST, OP_LOCAL0, OP_LOCAL, OP_GLOBAL, OP_SETLOCAL, OP_SETGLOBAL, OP_DEFINE,
+       OP_POP, OP_JUMP, OP_JUMPF, OP_ANDJ, OP_ORJ, OP_CLOSURE, OP_CALL, OP_TAILCALL,
+       OP_RETURN, OP_APPLY, OP_EVAL };
+
+int usevm;
+
+typedef struct {
+  long *words;
+  long len;
+  long cap;
+  Obj *consts;			/* in reverse order */
+  long nconsts;
+  int depth;
+  int maxdepth;
+} Assembler;
+
+void emitword(Assembler *as, long word)
+{
+  if (as->len == as->cap) {
+    as->cap = as->cap ? 2 * as->cap : 64;
+    as->words = realloc(as->words, as->cap * sizeof(long));
+  }
+  as->words[as->len++] = word;
+}
+
+/* emit op, which changes the depth of the stack by delta */
+void emitop(Assembler *as, long op, int delta)
+{
+  emitword(as, op);
+  as->depth += delta;
+  if (as->depth > as->maxdepth)
+    as->maxdepth = as->depth;
+}
+
+long addconst(Assembler *as, Obj *o)
+{
+  as->consts = cons(o, as->consts);
+  return as->nconsts++;
+}
+
+/* emit a jump to be patched later, returning where its target goes */
+long emitjump(Assembler *as, long op, int delta)
+{
+  emitop(as, op, delta);
+  emitword(as, 0);
+  return as->len - 1;
+}
+
+void patchjump(Assembler *as, long at)
+{
+  as->words[at] = as->len;
+}
+
+Obj *makecode(Assembler *as, int arity, int framesize)
+{
+  Obj *consts = maketable(as->nconsts);
+  for (long i = as->nconsts - 1; i >= 0; --i, as->consts = cdr(as->consts))
+    TABLESLOTS(consts)[i] = car(as->consts);
+
+  PROTECT(consts);
+  Obj *code = allocbytes(sizeof(Obj) + as->len * sizeof(long));
+  UNPROTECT(1);
+  code->type = CODE;
+  code->data.code.consts = consts;
+  code->data.code.arity = arity;
+  code->data.code.framesize = framesize;
+  code->data.code.maxdepth = as->maxdepth;
+  code->data.code.size = as->len;
+  memcpy(CODEWORDS(code), as->words, as->len * sizeof(long));
+  free(as->words);
+  return code;
+}
+
+Obj *bytecompile(Obj *n, int arity, int framesize);
+
+void compilenode(Assembler *as, Obj *n, int tail);
+
+/* compile each node in list, leaving their values on the stack */
+int compileall(Assembler *as, Obj *list)
+{
+  int count = 0;
+  PROTECT(list);
+  for (; !isnull(list); list = cdr(list), ++count)
+    compilenode(as, car(list), 0);
+  UNPROTECT(1);
+  return count;
+}
+
+/* Compile n, leaving its value on the stack, or returning it if n is in
+   tail position. */
+void compilenode(Assembler *as, Obj *n, int tail)
+{
+  Obj *o = thenull;
+  long k, at, end, chain;
+  int count, depth;
+  GCSAVE;
+  PROTECT(n);
+  PROTECT(o);
+
+  switch (n->type) {
+  case CONST_NODE:
+    k = addconst(as, n->data.node.a);
+    emitop(as, OP_CONST, 1);
+    emitword(as, k);
+    break;
+  case LOCAL_REF_NODE:
+    k = addconst(as, n->data.node.c);
+    if (numval(n->data.node.a) == 0)
+      emitop(as, OP_LOCAL0, 1);
+    else {
+      emitop(as, OP_LOCAL, 1);
+      emitword(as, numval(n->data.node.a));
+    }
+    emitword(as, numval(n->data.node.b));
+    emitword(as, k);
+    break;
+  case GLOBAL_REF_NODE:
+    k = addconst(as, n->data.node.a);
+    emitop(as, OP_GLOBAL, 1);
+    emitword(as, k);
+    emitword(as, numval(n->data.node.b));
+    break;
+  case LOCAL_SET_NODE:
+    compilenode(as, n->data.node.c, 0);
+    emitop(as, OP_SETLOCAL, 0);
+    emitword(as, numval(n->data.node.a));
+    emitword(as, numval(n->data.node.b));
+    break;
+  case GLOBAL_SET_NODE:
+    compilenode(as, n->data.node.b, 0);
+    k = addconst(as, n->data.node.a);
+    emitop(as, OP_SETGLOBAL, 0);
+    emitword(as, k);
+    emitword(as, numval(n->data.node.c));
+    break;
+  case DEFINE_NODE:
+    compilenode(as, n->data.node.b, 0);
+    k = addconst(as, n->data.node.a);
+    emitop(as, OP_DEFINE, 0);
+    emitword(as, k);
+    break;
+  case IF_NODE:
+    compilenode(as, n->data.node.a, 0);
+    at = emitjump(as, OP_JUMPF, -1);
+    depth = as->depth;
+    compilenode(as, n->data.node.b, tail);
+    if (tail) {
+      patchjump(as, at);
+      as->depth = depth;
+      compilenode(as, n->data.node.c, tail);
+    } else {
+      end = emitjump(as, OP_JUMP, 0);
+      patchjump(as, at);
+      as->depth = depth;
+      compilenode(as, n->data.node.c, tail);
+      patchjump(as, end);
+    }
+    GCRESTORE;
+    return;
+  case LAMBDA_NODE:
+    o = bytecompile(n->data.node.b, numval(n->data.node.a), numval(n->data.node.c));
+    k = addconst(as, o);
+    emitop(as, OP_CLOSURE, 1);
+    emitword(as, k);
+    break;
+  case SEQ_NODE:
+    for (o = n->data.node.a; !isnull(cdr(o)); o = cdr(o)) {
+      compilenode(as, car(o), 0);
+      emitop(as, OP_POP, -1);
+    }
+    compilenode(as, car(o), tail);
+    GCRESTORE;
+    return;
+  case AND_NODE:
+  case OR_NODE:
+    /* The tests which decide the result jump to the end with it on the
+       stack. Until they are patched, each jump's target holds the
+       position of the previous one. */
+    chain = -1;
+    depth = 0;
+    for (o = n->data.node.a; !isnull(cdr(o)); o = cdr(o)) {
+      compilenode(as, car(o), 0);
+      depth = as->depth;
+      at = emitjump(as, n->type == AND_NODE ? OP_ANDJ : OP_ORJ, -1);
+      as->words[at] = chain;
+      chain = at;
+    }
+    compilenode(as, car(o), tail);
+    if (chain < 0) {
+      GCRESTORE;
+      return;
+    }
+    while (chain >= 0) {
+      at = as->words[chain];
+      patchjump(as, chain);
+      chain = at;
+    }
+    as->depth = depth;
+    if (tail)
+      emitop(as, OP_RETURN, -1);
+    GCRESTORE;
+    return;
+  case APPLY_NODE:
+    compilenode(as, n->data.node.a, 0);
+    count = compileall(as, n->data.node.b);
+    emitop(as, OP_APPLY, -count);
+    emitword(as, count);
+    break;
+  case EVAL_NODE:
+    compilenode(as, n->data.node.a, 0);
+    compilenode(as, n->data.node.b, 0);
+    emitop(as, OP_EVAL, -1);
+    break;
+  case CALL_NODE:
+    compilenode(as, n->data.node.a, 0);
+    count = compileall(as, n->data.node.b);
+    emitop(as, tail ? OP_TAILCALL : OP_CALL, -count);
+    emitword(as, count);
+    if (tail) {
+      GCRESTORE;
+      return;
+    }
+    break;
   default:
-    fprintf(stderr, "cannot eval object: ");
-    write(stderr, o);
+    fprintf(stderr, "cannot compile node: ");
+    write(stderrwriter, n);
     ERROR("\n");
   }
+
+  if (tail)
+    emitop(as, OP_RETURN, -1);
+  GCRESTORE;
 }
 
-void writepair(FILE *out, Obj *o)
+/* compile the body of a lambda, or a top-level form */
+Obj *bytecompile(Obj *n, int arity, int framesize)
 {
-  write(out, car(o));
+  Assembler as = { NULL, 0, 0, thenull, 0, 0, 0 };
+  PROTECT(as.consts);
+  compilenode(&as, n, 1);
+  Obj *code = makecode(&as, arity, framesize);
+  UNPROTECT(1);
+  return code;
+}
 
-  if (isnull(cdr(o)));
-  else if (cdr(o)->type == PAIR) {
-    fprintf(out, " ");
-    writepair(out, cdr(o));
-  } else {
-    fprintf(out, " . ");
-    write(out, cdr(o));
+/* The machine
+
+   Values are kept on vmstack. Each call in progress has a VMFrame
+   recording where to return to, and a VMFrame with no code marks the
+   return from vmrun to its caller. Both stacks are roots for the
+   garbage collector, which may move the code object being run, so the
+   position in it is kept as an index across anything that allocates. */
+
+typedef struct {
+  Obj *code;
+  long pc;
+  Obj *env;
+} VMFrame;
+
+Obj **vmstack;
+Obj **vmsp;
+Obj **vmstacklimit;
+
+VMFrame *vmframes;
+long vmnframes;
+long vmframecap;
+
+/* the argument lists of the primitive calls in progress, which are
+   built on the C stack (see vmcallprim) */
+typedef struct VMPrimArgs {
+  Obj *cells;
+  long n;
+  struct VMPrimArgs *prev;
+} VMPrimArgs;
+
+VMPrimArgs *vmprimargs = NULL;
+
+#define VMPUSH(o) (*vmsp++ = (o))
+#define VMPOP (*--vmsp)
+
+void vmgcroots(char **next)
+{
+  for (Obj **p = vmstack; p < vmsp; ++p)
+    *p = gccopy(*p, next);
+  for (long i = 0; i < vmnframes; ++i) {
+    vmframes[i].code = gccopy(vmframes[i].code, next);
+    vmframes[i].env = gccopy(vmframes[i].env, next);
   }
+  for (VMPrimArgs *a = vmprimargs; a != NULL; a = a->prev)
+    for (long i = 0; i < a->n; ++i)
+      a->cells[i].data.pair.car = gccopy(a->cells[i].data.pair.car, next);
 }
 
-void write(FILE *out, Obj *o)
+void vmreserve(long n)
 {
-  switch (o->type) {
+  if (vmsp + n <= vmstacklimit)
+    return;
+  long depth = vmsp - vmstack;
+  long size = vmstacklimit - vmstack;
+  while (size < depth + n)
+    size = size ? 2 * size : 1024;
+  vmstack = realloc(vmstack, size * sizeof(Obj *));
+  vmsp = vmstack + depth;
+  vmstacklimit = vmstack + size;
+}
+
+void vmpushframe(Obj *code, long pc, Obj *env)
+{
+  if (vmnframes == vmframecap) {
+    vmframecap = vmframecap ? 2 * vmframecap : 256;
+    vmframes = realloc(vmframes, vmframecap * sizeof(VMFrame));
+  }
+  vmframes[vmnframes].code = code;
+  vmframes[vmnframes].pc = pc;
+  vmframes[vmnframes].env = env;
+  ++vmnframes;
+}
+
+/* A frame for calling proc on the top n values of the stack, which are
+   popped along with proc. */
+Obj *vmcallframe(Obj *proc, long n)
+{
+  Obj *frame = thenull;
+  Obj *rest = thenull;
+  GCSAVE;
+  PROTECT(proc);
+  PROTECT(frame);
+  PROTECT(rest);
+
+  long arity = procarity(proc);
+  long nrequired = arity >= 0 ? arity : -arity - 1;
+  frame = makeframe(procframesize(proc), proc->data.compproc.env);
+
+  Obj **args = vmsp - n;
+  for (long i = 0; i < n && i < nrequired; ++i)
+    FRAMESLOTS(frame)[i] = args[i];
+  if (arity < 0) {
+    for (long i = n - 1; i >= nrequired; --i)
+      rest = cons(args[i], rest);
+    FRAMESLOTS(frame)[nrequired] = rest;
+  }
+  vmsp -= n + 1;
+
+  GCRETURN(frame);
+}
+
+/* the top n values of the stack as a list, popping them */
+Obj *vmpoplist(long n, Obj *tail)
+{
+  PROTECT(tail);
+  for (long i = 1; i <= n; ++i)
+    tail = cons(vmsp[-i], tail);
+  UNPROTECT(1);
+  vmsp -= n;
+  return tail;
+}
+
+/* Call the primitive proc on the top n values of the stack, which are
+   popped along with proc. Consing the argument list costs about as much
+   as the rest of the VM's work on compiler.scm, so it is built from
+   cells on the C stack instead. The collector updates the cells' cars,
+   so a primitive may allocate before reading its arguments, but it must
+   not keep the list's pairs (see initenv). list hands its arguments
+   back, so a result that is one of the cells is copied to the heap. */
+Obj *vmcallprim(Obj *proc, long n)
+{
+  Obj cells[n > 0 ? n : 1];
+  Obj *args = thenull;
+  for (long i = n - 1; i >= 0; --i) {
+    cells[i].type = PAIR;
+    cells[i].data.pair.car = vmsp[i - n];
+    cells[i].data.pair.cdr = args;
+    args = &cells[i];
+  }
+
+  VMPrimArgs primargs = { cells, n, vmprimargs };
+  vmprimargs = &primargs;
+  Obj *o = (*(proc->data.primproc.proc))(args);
+  vmprimargs = primargs.prev;
+  long popped = 0;
+  if (o >= cells && o < cells + n) {
+    popped = n - (o - cells);
+    o = vmpoplist(popped, thenull);
+  }
+  vmsp -= n - popped + 1;
+  return o;
+}
+
+/* run code, the body of a procedure called in env, to completion */
+Obj *vmrun(Obj *code, Obj *env)
+{
+  static void *ops[] = {
+    [OP_CONST] = &&op_const, [OP_LOCAL0] = &&op_local0, [OP_LOCAL] = &&op_local,
+    [OP_GLOBAL] = &&op_global, [OP_SETLOCAL] = &&op_setlocal, [OP_SETGLOBAL] = &&op_setglobal,
+    [OP_DEFINE] = &&op_define, [OP_POP] = &&op_pop, [OP_JUMP] = &&op_jump,
+    [OP_JUMPF] = &&op_jumpf, [OP_ANDJ] = &&op_andj, [OP_ORJ] = &&op_orj,
+    [OP_CLOSURE] = &&op_closure, [OP_CALL] = &&op_call, [OP_TAILCALL] = &&op_tailcall,
+    [OP_RETURN] = &&op_return, [OP_APPLY] = &&op_apply, [OP_EVAL] = &&op_eval,
+  };
+  Obj *proc = thenull;
+  Obj *args = thenull;
+  Obj *o;
+  long *ip;
+  long pc, k, n;
+  int tail;
+  GCSAVE;
+  PROTECT(code);
+  PROTECT(env);
+  PROTECT(proc);
+  PROTECT(args);
+
+#define CONSTS TABLESLOTS(code->data.code.consts)
+#define SAVEPC (pc = ip - CODEWORDS(code))
+#define LOADPC (ip = CODEWORDS(code) + pc)
+#define NEXT goto *ops[*ip++]
+
+  vmpushframe(NULL, 0, NULL);
+ enter:
+  vmreserve(code->data.code.maxdepth);
+  ip = CODEWORDS(code);
+  NEXT;
+
+ op_const:
+  VMPUSH(CONSTS[*ip++]);
+  NEXT;
+
+ op_local0:
+  o = FRAMESLOTS(env)[ip[0]];
+  goto local;
+ op_local:
+  o = FRAMESLOTS(frameup(env, ip[0]))[ip[1]];
+  ++ip;
+ local:
+  if (o == NULL) {
+    fprintf(stderr, "unassigned variable: ");
+    write(stderrwriter, CONSTS[ip[1]]);
+    ERROR("\n");
+  }
+  ip += 2;
+  VMPUSH(o);
+  NEXT;
+
+ op_global:
+  o = CONSTS[ip[0]];
+  if (gettype(o) == SYMBOL) {
+    o = envlookup(o, frameup(env, ip[1]));
+    CONSTS[ip[0]] = o;
+  }
+  ip += 2;
+  VMPUSH(cdr(o));
+  NEXT;
+
+ op_setlocal:
+  FRAMESLOTS(frameup(env, ip[0]))[ip[1]] = vmsp[-1];
+  vmsp[-1] = theok;
+  ip += 2;
+  NEXT;
+
+ op_setglobal:
+  setcdr(envlookup(CONSTS[ip[0]], frameup(env, ip[1])), vmsp[-1]);
+  vmsp[-1] = theok;
+  ip += 2;
+  NEXT;
+
+ op_define:
+  k = *ip++;
+  SAVEPC;
+  define(CONSTS[k], vmsp[-1], env);
+  LOADPC;
+  vmsp[-1] = theok;
+  NEXT;
+
+ op_pop:
+  --vmsp;
+  NEXT;
+
+ op_jump:
+  ip = CODEWORDS(code) + ip[0];
+  NEXT;
+
+ op_jumpf:
+  if (isfalse(VMPOP))
+    ip = CODEWORDS(code) + ip[0];
+  else
+    ++ip;
+  NEXT;
+
+ op_andj:
+  if (isfalse(vmsp[-1]))
+    ip = CODEWORDS(code) + ip[0];
+  else {
+    --vmsp;
+    ++ip;
+  }
+  NEXT;
+
+ op_orj:
+  if (ISTRUTHY(vmsp[-1]))
+    ip = CODEWORDS(code) + ip[0];
+  else {
+    --vmsp;
+    ++ip;
+  }
+  NEXT;
+
+ op_closure:
+  k = *ip++;
+  SAVEPC;
+  o = makecompproc(CONSTS[k], env);
+  LOADPC;
+  VMPUSH(o);
+  NEXT;
+
+ op_call:
+  tail = 0;
+  goto call;
+ op_tailcall:
+  tail = 1;
+ call:
+  n = *ip++;
+  SAVEPC;
+  proc = vmsp[-n - 1];
+  switch (gettype(proc)) {
+  case PRIM_PROC:
+    o = vmcallprim(proc, n);
+    break;
+  case COMP_PROC:
+    o = vmcallframe(proc, n);
+    if (!tail)
+      vmpushframe(code, pc, env);
+    code = proc->data.compproc.lambda;
+    env = o;
+    goto enter;
+  default:
+    goto notaprocedure;
+  }
+  LOADPC;
+  VMPUSH(o);
+  if (tail)
+    goto op_return;
+  NEXT;
+
+ op_return:
+  o = VMPOP;
+  --vmnframes;
+  if (vmframes[vmnframes].code == NULL)
+    GCRETURN(o);
+  code = vmframes[vmnframes].code;
+  env = vmframes[vmnframes].env;
+  pc = vmframes[vmnframes].pc;
+  LOADPC;
+  VMPUSH(o);
+  NEXT;
+
+ op_apply:
+  n = *ip++;
+  SAVEPC;
+  if (n == 0)
+    args = thenull;
+  else {
+    args = VMPOP;
+    args = vmpoplist(n - 1, args);
+  }
+  proc = VMPOP;
+  switch (gettype(proc)) {
+  case PRIM_PROC:
+    o = (*(proc->data.primproc.proc))(args);
+    LOADPC;
+    VMPUSH(o);
+    NEXT;
+  case COMP_PROC:
+    o = bindframe(proc, args);
+    vmpushframe(code, pc, env);
+    code = proc->data.compproc.lambda;
+    env = o;
+    goto enter;
+  default:
+    goto notaprocedure;
+  }
+
+ op_eval:
+  SAVEPC;
+  o = analyze(vmsp[-2], thenull);
+  o = bytecompile(o, 0, 0);
+  vmpushframe(code, pc, env);
+  code = o;
+  env = vmsp[-1];
+  vmsp -= 2;
+  goto enter;
+
+ notaprocedure:
+  fprintf(stderr, "not a procedure: ");
+  write(stderrwriter, proc);
+  ERROR("\n");
+
+#undef CONSTS
+#undef SAVEPC
+#undef LOADPC
+#undef NEXT
+}
+
+Obj *eval(Obj *o, Obj *env)
+{
+  PROTECT(env);
+  Obj *node = analyze(o, thenull);
+  if (usevm)
+    node = bytecompile(node, 0, 0);
+  UNPROTECT(1);
+  return usevm ? vmrun(node, env) : exec(node, env);
+}
+
+void writepair(Writer *out, Obj *o)
+{
+  write(out, car(o));
+  for (o = cdr(o); gettype(o) == PAIR; o = cdr(o)) {
+    wputc(out, ' ');
+    write(out, car(o));
+  }
+  if (!isnull(o)) {
+    wputs(out, " . ");
+    write(out, o);
+  }
+}
+
+void write(Writer *out, Obj *o)
+{
+  switch (gettype(o)) {
   case NUMBER:
-    fprintf(out, "%ld", o->data.fixnum.val);
+    wputl(out, numval(o));
     break;
   case BOOLEAN:
-    fprintf(out, "#%c", istrue(o) ? 't' : 'f');
+    wputs(out, istrue(o) ? "#t" : "#f");
     break;
   case CHAR:
-    switch (o->data._char.val) {
+    switch (CHARVAL(o)) {
     case '\n':
-      fprintf(out, "#\\newline");
+      wputs(out, "#\\newline");
       break;
     case ' ':
-      fprintf(out, "#\\space");
+      wputs(out, "#\\space");
       break;
     default:
-      fprintf(out, "#\\%c", o->data._char.val);
+      wputs(out, "#\\");
+      wputc(out, CHARVAL(o));
     }
     break;
   case STRING:
-    fprintf(out, "\"");
-    for (char *str = o->data.string.val; *str != '\0'; str++)
+    wputc(out, '"');
+    for (char *str = o->data.string.val; *str != '\0'; str++) {
+      size_t n = strcspn(str, "\"\n\\");
+      wputn(out, str, n);
+      str += n;
       switch(*str) {
       case '"':
-	fprintf(out, "\\\"");
+	wputs(out, "\\\"");
 	break;
       case '\n':
-	fprintf(out, "\\n");
+	wputs(out, "\\n");
 	break;
       case '\\':
-	fprintf(out, "\\\\");
+	wputs(out, "\\\\");
 	break;
       default:
-	fprintf(out, "%c", *str);
+	--str;
       }
-    fprintf(out, "\"");
+    }
+    wputc(out, '"');
     break;
   case SYMBOL:
-    fprintf(out, "%s", o->data.symbol.name);
+    wputn(out, o->data.symbol.name, o->data.symbol.len);
     break;
   case _NULL:
-    fprintf(out, "()");
+    wputs(out, "()");
     break;
   case PAIR:
     if (isquote(car(o))) {
-      fprintf(out, "'");
+      wputc(out, '\'');
       write(out, cadr(o));
     } else {
-      fprintf(out, "(");
+      wputs(out, "(");
       writepair(out, o);
-      fprintf(out, ")");
+      wputs(out, ")");
     }
     break;
   case PRIM_PROC:
   case COMP_PROC:
-    fprintf(out, "#<procedure>");
+    wputs(out, "#<procedure>");
     break;
   case _EOF:
-    fprintf(out, "#<eof>");
+    wputs(out, "#<eof>");
     break;
   case INPUT_PORT:
-    fprintf(out, "#<input-port>");
+    wputs(out, "#<input-port>");
     break;
   case OUTPUT_PORT:
-    fprintf(out, "#<output-port>");
+    wputs(out, "#<output-port>");
+    break;
+  case FRAME:
+    wputs(out, "#<frame>");
+    break;
+  case TABLE:
+    wputs(out, "#<table>");
+    break;
+  case ENVIRONMENT:
+    wputs(out, "#<environment>");
+    break;
+  case CODE:
+    wputs(out, "#<code>");
+    break;
+  case CONST_NODE:
+  case LOCAL_REF_NODE:
+  case GLOBAL_REF_NODE:
+  case LOCAL_SET_NODE:
+  case GLOBAL_SET_NODE:
+  case DEFINE_NODE:
+  case IF_NODE:
+  case LAMBDA_NODE:
+  case SEQ_NODE:
+  case AND_NODE:
+  case OR_NODE:
+  case APPLY_NODE:
+  case EVAL_NODE:
+  case CALL_NODE:
+    wputs(out, "#<syntax>");
+    break;
+  case _FORWARD:
+    wputs(out, "#<forwarded object>");
     break;
   }
 }
 
+/* Heap images
+
+   --dump-image writes the heap as it is after loading a file, along
+   with the global roots, the symbol table and the text of strings and
+   symbols, so that --image can start from it without reading any
+   source. The heap is collected before it is written, so it holds only
+   live objects laid out end to end. Reading it back maps the file,
+   copies the heap into a new semispace and moves every pointer in it by
+   the distance between the old heap and the new one, and every
+   primitive by the distance between the old and new text, since the
+   interpreter may be loaded at a different address. Strings get a
+   malloc'd copy of their text as usual, but symbols, which are never
+   freed, point into the mapping. */
+
+#define IMAGE_MAGIC "scheme image 1\n"
+
+typedef struct {
+  char magic[16];
+  char build[32];		/* the interpreter which wrote the image */
+  char *heapbase;
+  size_t heapbytes;
+  size_t textbytes;
+  size_t symtabsize;
+  size_t nsymbols;
+  size_t nroots;
+  Obj *(*anchor)(Obj *);	/* where car was */
+  int usevm;
+} ImageHeader;
+
+#define BUILD_ID __DATE__ " " __TIME__
+
+size_t countroots()
+{
+  size_t n = 0;
+  while (globalroots[n] != NULL)
+    ++n;
+  return n;
+}
+
+void dumpimage(char *path)
+{
+  gc(0);
+
+  FILE *file = fopen(path, "w");
+  if (file == NULL)
+    ERROR("could not open %s\n", path);
+
+  ImageHeader header;
+  memset(&header, 0, sizeof(header));
+  strcpy(header.magic, IMAGE_MAGIC);
+  strcpy(header.build, BUILD_ID);
+  header.heapbase = heapbase;
+  header.heapbytes = heapfree - heapbase;
+  header.symtabsize = symtabsize;
+  header.nsymbols = nsymbols;
+  header.nroots = countroots();
+  header.anchor = car;
+  header.usevm = usevm;
+
+  /* the text of strings and symbols is replaced by its offset in the
+     text section, and ports, which cannot outlive the process, by NULL */
+  char *heap = malloc(header.heapbytes);
+  memcpy(heap, heapbase, header.heapbytes);
+  Writer *text = makewriter(NULL);
+  size_t textbytes = 0;
+  for (char *p = heap; p < heap + header.heapbytes; p += objsize((Obj *)p)) {
+    Obj *o = (Obj *)p;
+    size_t len;
+    switch (o->type) {
+    case STRING:
+      len = strlen(o->data.string.val) + 1;
+      o->data.string.val = (char *)textbytes;
+      break;
+    case SYMBOL:
+      len = o->data.symbol.len + 1;
+      o->data.symbol.name = (char *)textbytes;
+      break;
+    case INPUT_PORT:
+      o->data.inputport.reader = NULL;
+      continue;
+    case OUTPUT_PORT:
+      o->data.outputport.writer = NULL;
+      continue;
+    default:
+      continue;
+    }
+    textbytes += len;
+  }
+  header.textbytes = textbytes;
+
+  fwrite(&header, sizeof(header), 1, file);
+  for (Obj ***r = globalroots; *r != NULL; ++r)
+    fwrite(*r, sizeof(Obj *), 1, file);
+  fwrite(symtab, sizeof(Obj *), symtabsize, file);
+  fwrite(heap, 1, header.heapbytes, file);
+
+  text->file = file;
+  for (char *p = heapbase; p < heapfree; p += objsize((Obj *)p)) {
+    Obj *o = (Obj *)p;
+    if (o->type == STRING)
+      wputn(text, o->data.string.val, strlen(o->data.string.val) + 1);
+    else if (o->type == SYMBOL)
+      wputn(text, o->data.symbol.name, o->data.symbol.len + 1);
+  }
+  closewriter(text);
+  free(heap);
+}
+
+#define MOVE(o, delta) ((o) == NULL || ISIMMEDIATE(o) ? (o) : (Obj *)((char *)(o) + (delta)))
+
+/* the same fields gcscan visits, and the ones outside the heap */
+void relocate(Obj *o, ptrdiff_t delta, ptrdiff_t textdelta, char *text)
+{
+  switch (o->type) {
+  case STRING: {
+    char *str = text + (size_t)o->data.string.val;
+    size_t len = strlen(str) + 1;
+    o->data.string.val = malloc(len);
+    memcpy(o->data.string.val, str, len);
+    break;
+  }
+  case SYMBOL:
+    o->data.symbol.name = text + (size_t)o->data.symbol.name;
+    break;
+  case PRIM_PROC:
+    o->data.primproc.proc = (Obj *(*)(Obj *))((char *)o->data.primproc.proc + textdelta);
+    break;
+  case INPUT_PORT:
+    o->data.inputport.reader = makereader(NULL);
+    break;
+  case OUTPUT_PORT:
+    o->data.outputport.writer = makewriter(NULL);
+    break;
+  case PAIR:
+    o->data.pair.car = MOVE(o->data.pair.car, delta);
+    o->data.pair.cdr = MOVE(o->data.pair.cdr, delta);
+    break;
+  case COMP_PROC:
+    o->data.compproc.lambda = MOVE(o->data.compproc.lambda, delta);
+    o->data.compproc.env = MOVE(o->data.compproc.env, delta);
+    break;
+  case FRAME:
+    o->data.frame.parent = MOVE(o->data.frame.parent, delta);
+    for (long i = 0; i < o->data.frame.size; ++i)
+      FRAMESLOTS(o)[i] = MOVE(FRAMESLOTS(o)[i], delta);
+    break;
+  case TABLE:
+    for (long i = 0; i < o->data.table.size; ++i)
+      TABLESLOTS(o)[i] = MOVE(TABLESLOTS(o)[i], delta);
+    break;
+  case ENVIRONMENT:
+    o->data.environment.table = MOVE(o->data.environment.table, delta);
+    break;
+  case CODE:
+    o->data.code.consts = MOVE(o->data.code.consts, delta);
+    break;
+  case CONST_NODE:
+  case LOCAL_REF_NODE:
+  case GLOBAL_REF_NODE:
+  case LOCAL_SET_NODE:
+  case GLOBAL_SET_NODE:
+  case DEFINE_NODE:
+  case IF_NODE:
+  case LAMBDA_NODE:
+  case SEQ_NODE:
+  case AND_NODE:
+  case OR_NODE:
+  case APPLY_NODE:
+  case EVAL_NODE:
+  case CALL_NODE:
+    o->data.node.a = MOVE(o->data.node.a, delta);
+    o->data.node.b = MOVE(o->data.node.b, delta);
+    o->data.node.c = MOVE(o->data.node.c, delta);
+    break;
+  default:
+    break;
+  }
+}
+
+void loadimage(char *path)
+{
+  FILE *file = fopen(path, "r");
+  struct stat st;
+  if (file == NULL || fstat(fileno(file), &st) != 0) {
+    fprintf(stderr, "could not open %s\n", path);
+    exit(1);
+  }
+  char *image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+  fclose(file);
+  ImageHeader *header = (ImageHeader *)image;
+  if (image == MAP_FAILED || (size_t)st.st_size < sizeof(ImageHeader) ||
+      strcmp(header->magic, IMAGE_MAGIC) != 0) {
+    fprintf(stderr, "%s is not an image\n", path);
+    exit(1);
+  }
+  if (strcmp(header->build, BUILD_ID) != 0 || header->nroots != countroots()) {
+    fprintf(stderr, "%s was made by a different interpreter\n", path);
+    exit(1);
+  }
+  if (usevm != header->usevm) {
+    fprintf(stderr, "%s was made %s --vm\n", path, header->usevm ? "with" : "without");
+    exit(1);
+  }
+
+  Obj **roots = (Obj **)(header + 1);
+  Obj **symbols = roots + header->nroots;
+  char *heap = (char *)(symbols + header->symtabsize);
+  char *text = heap + header->heapbytes;
+
+  initgc();
+  size_t size = heapsize;
+  while (size < 2 * header->heapbytes)
+    size *= 2;
+  if (size != heapsize) {
+    free(heapbase);
+    free(sparebase);
+    heapsize = sparesize = size;
+    heapbase = malloc(heapsize);
+    sparebase = malloc(sparesize);
+    heaplimit = heapbase + heapsize;
+  }
+  memcpy(heapbase, heap, header->heapbytes);
+  heapfree = heapbase + header->heapbytes;
+  livebytes = peaklivebytes = header->heapbytes;
+
+  ptrdiff_t delta = heapbase - header->heapbase;
+  ptrdiff_t textdelta = (char *)car - (char *)header->anchor;
+  for (char *p = heapbase; p < heapfree; p += objsize((Obj *)p))
+    relocate((Obj *)p, delta, textdelta, text);
+  for (size_t i = 0; i < header->nroots; ++i)
+    *globalroots[i] = MOVE(roots[i], delta);
+  symtabsize = header->symtabsize;
+  symtab = malloc(symtabsize * sizeof(Obj *));
+  for (size_t i = 0; i < symtabsize; ++i)
+    symtab[i] = MOVE(symbols[i], delta);
+  nsymbols = header->nsymbols;
+
+  initports();
+}
+
 Obj *makeargslist(int argc, char *argv[], int i)
 {
-  if (i < argc)
-    return cons(makestring(argv[i], strlen(argv[i])+1), makeargslist(argc, argv, i+1));
-  return thenull;
+  Obj *list = thenull;
+  PROTECT(list);
+  for (int j = argc - 1; j >= i; --j) {
+    Obj *arg = makestring(argv[j], strlen(argv[j])+1);
+    PUSH(arg, list);
+  }
+  UNPROTECT(1);
+  return list;
 }
 
 int main(int argc, char *argv[])
 {
-  init();
-  interactionenv = cons(predefinedenv, thenull);
+  int i = 1;
+  char *dump = NULL;
+  char *image = NULL;
+  for (; i < argc && strncmp(argv[i], "--", 2) == 0; ++i)
+    if (strcmp(argv[i], "--vm") == 0)
+      usevm = 1;
+    else if (strcmp(argv[i], "--dump-image") == 0 && i + 1 < argc)
+      dump = argv[++i];
+    else if (strcmp(argv[i], "--image") == 0 && i + 1 < argc)
+      image = argv[++i];
+    else
+      break;
+
+  if (image != NULL)
+    loadimage(image);
+  else
+    init();
 
-  if (argc == 1) {
+  if (argc == i && image == NULL) {
     Obj *o;
     setjmp(errbuf);
+    gcnroots = 0;
+    vmsp = vmstack;
+    vmnframes = 0;
+    vmprimargs = NULL;
     while (1) {
-      printf("> ");
-      o = read(stdin);
+      wputs(stdoutwriter, "> ");
+      o = read(stdinreader);
       if (o == NULL)
 	break;
-      write(stdout, eval(o, interactionenv));
-      printf("\n");
+      write(stdoutwriter, eval(o, interactionenv));
+      wputc(stdoutwriter, '\n');
     }
   } else {
     if (setjmp(errbuf))
       return 1;
-    load(cons(makestring(argv[1], strlen(argv[1])+1), thenull));
-    Obj *argslist = makeargslist(argc, argv, 2);
-    Obj *cmd = cons(MAKE_CONSTANT_SYMBOL("main"), cons(cons(thequote, cons(argslist, thenull)), thenull));
+    if (image == NULL) {
+      Obj *file = makestring(argv[i], strlen(argv[i])+1);
+      load(cons(file, thenull));
+      ++i;
+    }
+    if (dump != NULL) {
+      dumpimage(dump);
+      return 0;
+    }
+    Obj *cmd = makeargslist(argc, argv, i);
+    PROTECT(cmd);
+    cmd = cons(cmd, thenull);
+    cmd = cons(thequote, cmd);
+    cmd = cons(cmd, thenull);
+    Obj *mainsym = MAKE_CONSTANT_SYMBOL("main");
+    cmd = cons(mainsym, cmd);
     eval(cmd, interactionenv);
   }
   return 0;
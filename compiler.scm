@@ -12,8 +12,11 @@
 (define fxmask 1)
 (define fxtag 1)
 
-(define fxmin (- (lsh 1 (- wordsizebits 2))))
-(define fxmax (- (lsh 1 (- wordsizebits 2)) 1))
+(define fxmax (+ (lsh 1 (- wordsizebits 3)) (- (lsh 1 (- wordsizebits 3)) 1)))
+(define fxmin (- -1 fxmax))
+
+;; the largest fixnum whose tagged value is also a fixnum
+(define tagged-fxmax (- (lsh 1 (- wordsizebits 3)) 1))
 
 (define (fixnum? x)
   (and (number? x) (<= fxmin x fxmax)))
@@ -39,6 +42,9 @@
 (define nulltag 0)
 (define null (+ (lsh nulltag specialshift) specialtag))
 
+(define eoftag 2)
+(define eof (+ (lsh eoftag specialshift) specialtag))
+
 ;; compile immediate objects
 
 (define (imm? x)
@@ -46,25 +52,55 @@
 
 (define (const? x) (or (imm? x) (null? x) (string? x)))
 
+;; Fixnums are tagged here unless the tagged value would overflow the
+;; compiler's own fixnums when it is itself compiled, and then by C.
 (define (compile-imm x)
   (cond
-   ((fixnum? x) (+ fxtag (lsh x fxshift)))
+   ((fixnum? x) (if (<= (- -1 tagged-fxmax) x tagged-fxmax)
+                    (c-number (+ fxtag (lsh x fxshift)))
+                    (convert (c-number x) 'long 'scm)))
    ((boolean? x) (if x t f))
-   ((char? x) (+ ctag (lsh x cshift)))))
+   ((char? x) (+ ctag (lsh (char->integer x) cshift)))))
 
 (define (compile-null)
   null)
 
+;; Strings and quoted data are built once, when the program starts, into
+;; the constants table, which is registered with the garbage collector as
+;; a root. Each symbol gets a single entry, so it is interned only once.
+
+(define *constants* '())
+
+(define (constant-ref i)
+  (string-append "constants[" (number->string i) "]"))
+
+(define (add-constant init)
+  (let ((i (length *constants*)))
+    (set! *constants* (cons init *constants*))
+    (constant-ref i)))
+
 ;; compile strings
 
 (define (compile-string x)
-  (list "allocstring(\"" x "\"," (string-length x) ")"))
+  (add-constant (list "allocstring(" (c-string x) "," (string-length x) ")")))
+
+;; a C string literal, written with its quotes, backslashes and newlines
+;; escaped (see emit)
+(define (c-string s)
+  (list 'c-string s))
 
 ;; compile symbols
 
+(define *symbol-constants* '())
+
 (define (compile-symbol x)
-  (let ((s (symbol->string x)))
-    (list "allocsymbol(\"" s "\"," (string-length s) ")")))
+  (let ((ref (assq-ref x *symbol-constants*)))
+    (if ref
+        ref
+        (let ((s (symbol->string x)))
+          (let ((ref (add-constant (list "allocsymbol(" (c-string s) "," (string-length s) ")"))))
+            (set! *symbol-constants* (cons (cons x ref) *symbol-constants*))
+            ref)))))
 
 ;; compile pairs
 
@@ -72,124 +108,265 @@
   (cond
    ((null? x) (compile-null))
    ((pair? x)
-    (list "cons" (list (compile-quoted (car x))
-                       ","
-                       (compile-quoted-pair (cdr x)))))
+    (let ((car-ref (compile-quoted (car x))))
+      (let ((cdr-ref (compile-quoted-pair (cdr x))))
+        (add-constant (list "cons" (list car-ref "," cdr-ref))))))
    (else (compile-quoted x))))
 
+;; Representations
+
+;; A primitive computes its result in one of three representations: scm,
+;; a tagged value; long, an untagged fixnum; or bool, a C truth value.
+;; Each expression is compiled in the representation its context wants,
+;; so nested primitives pass raw values between them, and a value is
+;; only tagged where it escapes into a variable, the heap or a call.
+
+(define (to-bool x) (list (list x '<< bshift) '+ btag))
+
+(define (convert code from to)
+  (cond
+   ((eq? from to) code)
+   ((eq? to 'scm)
+    (if (eq? from 'long)
+        (list (list (list "(scm)" code) '<< fxshift) "|" fxtag)
+        (to-bool code)))
+   ((eq? to 'long)
+    (if (eq? from 'scm)
+        (list (list "(long)" code) '>> fxshift)
+        (convert (convert code from 'scm) 'scm 'long)))
+   ;; every value but #f is true
+   ((eq? from 'scm) (list code '!= f))
+   (else (list code ",1"))))
+
+(define (compile-as x env want)
+  (cond
+   ((and (fixnum? x) (eq? want 'long)) (c-number x))
+   ((and (imm? x) (eq? want 'bool)) (if (eq? x #f) 0 1))
+   ((primcall? x) (compile-primcall x env want))
+   (else (convert (compile-expr x env) 'scm want))))
+
+;; negative numbers are parenthesized, so that they cannot run into a
+;; preceding minus sign
+(define (c-number n)
+  (if (< n 0) (list n) n))
+
 ;; define primitive procedures
 ;; TODO: primitive procedures should receive their arguments already evaluated
 
 (define *primitives* '())
 
+;; An expander is given the primitive's arguments, the environment and
+;; the representation wanted, and returns the representation it chose
+;; paired with the C code.
 (define (make-primitive name expander n)
   (set! *primitives* (cons (cons name (cons expander n)) *primitives*)))
 
 (define (binop r op l env) (list (compile-expr r env) op (compile-expr l env)))
 
 (define (make-unary-primitive name expander)
-  (make-primitive name (lambda (args env) (expander (car args) env)) 1))
+  (make-primitive name (lambda (args env want) (expander (car args) env want)) 1))
 
-(make-unary-primitive 'fxadd1 (lambda (x env) (binop x '+ (cc (lsh 1 fxshift)) env)))
-(make-unary-primitive 'fxsub1 (lambda (x env) (binop x '- (cc (lsh 1 fxshift)) env)))
+(define (make-binary-primitive name expander)
+  (make-primitive name (lambda (args env want) (expander (car args) (cadr args) env want)) 2))
+
+;; fixnum arithmetic is done on untagged values when that is wanted, and
+;; otherwise on tagged ones, which need at most one adjustment
+(define (fixnum-op long-op scm-op)
+  (lambda (x y env want)
+    (if (eq? want 'long)
+        (cons 'long (long-op (compile-as x env 'long) (compile-as y env 'long)))
+        (cons 'scm (scm-op x y env)))))
+
+(define (unary-fixnum-op long-op scm-op)
+  (lambda (x env want)
+    (if (eq? want 'long)
+        (cons 'long (long-op (compile-as x env 'long)))
+        (cons 'scm (scm-op (compile-as x env 'scm))))))
+
+(make-unary-primitive 'fxadd1 (unary-fixnum-op (lambda (x) (list x '+ 1))
+                                               (lambda (x) (list x '+ (lsh 1 fxshift)))))
+(make-unary-primitive 'fxsub1 (unary-fixnum-op (lambda (x) (list x '- 1))
+                                               (lambda (x) (list x '- (lsh 1 fxshift)))))
+
+(make-binary-primitive 'fx+ (fixnum-op (lambda (x y) (list x '+ y))
+                                       (lambda (x y env)
+                                         (list (compile-as x env 'scm) '+ (list (compile-as y env 'scm) '- fxtag)))))
+(make-binary-primitive 'fx- (fixnum-op (lambda (x y) (list x '- y))
+                                       (lambda (x y env)
+                                         (list (list (compile-as x env 'scm) '- (compile-as y env 'scm)) '+ fxtag))))
+(make-binary-primitive 'fx* (fixnum-op (lambda (x y) (list x '* y))
+                                       (lambda (x y env)
+                                         (list (list (list (compile-as x env 'scm) '- fxtag) '* (compile-as y env 'long))
+                                               '+ fxtag))))
+
+;; the tag bits of both are the same, and survive
+(make-binary-primitive 'fxlogand (fixnum-op (lambda (x y) (list x '& y))
+                                            (lambda (x y env) (list (compile-as x env 'scm) '& (compile-as y env 'scm)))))
+(make-binary-primitive 'fxlogor (fixnum-op (lambda (x y) (list x "|" y))
+                                           (lambda (x y env) (list (compile-as x env 'scm) "|" (compile-as y env 'scm)))))
 
 ;; only works because the high bit of ctag is 1
-(make-unary-primitive 'char->fixnum (lambda (x env) (binop x '>> (cc (- cshift fxshift)) env)))
+(make-unary-primitive 'char->fixnum (lambda (x env want)
+                                      (cons 'scm (list (compile-as x env 'scm) '>> (- cshift fxshift)))))
 
 ;; have to subtract 0b1000 because fxtag is already set
-(make-unary-primitive 'fixnum->char (lambda (x env)
-                                      (binop (cc (binop x '<< (cc (- cshift fxshift)) env))
-                                             '+
-                                             (cc (- ctag (lsh fxtag 3)))
-                                             env)))
+(make-unary-primitive 'fixnum->char (lambda (x env want)
+                                      (cons 'scm (list (list (compile-as x env 'scm) '<< (- cshift fxshift))
+                                                       '+
+                                                       (- ctag (lsh fxtag 3))))))
 
-(define (to-bool x) (list (list x '<< bshift) '+ btag))
+;; predicates give C truth values
 
-(make-unary-primitive 'null? (lambda (x env) (to-bool (binop x '== ''() env))))
-(make-unary-primitive 'not (lambda (x env) (to-bool (binop x '== #f env))))
-(make-unary-primitive 'fxzero? (lambda (x env) (to-bool (binop x '== 0 env))))
+(define (predicate test)
+  (lambda (x env want)
+    (cons 'bool (test (compile-as x env 'scm)))))
 
-(define (tagged? mask tag) (lambda (x env) (to-bool (binop (cc (binop x '& (cc mask) env))
-                                                           '==
-                                                           (cc tag)
-                                                           env))))
+(make-unary-primitive 'null? (predicate (lambda (x) (list x '== null))))
+(make-unary-primitive 'fxzero? (predicate (lambda (x) (list x '== fxtag))))
+
+(make-unary-primitive 'not (lambda (x env want)
+                             (cons 'bool (list "!" (compile-as x env 'bool)))))
+
+(define (tagged? mask tag)
+  (predicate (lambda (x) (list (list x '& mask) '== tag))))
 
 (make-unary-primitive 'fixnum? (tagged? fxmask fxtag))
 (make-unary-primitive 'boolean? (tagged? bmask btag))
 (make-unary-primitive 'char? (tagged? cmask ctag))
 
-(define (make-binary-primitive name expander)
-  (make-primitive name (lambda (args env) (expander (car args) (cadr args) env)) 2))
-
-(define (pure-binop op) (lambda (x y env) (binop x op y env)))
-
-(make-binary-primitive 'fx+ (lambda (x y env) (binop x '+ (cc (binop y '- (cc fxtag) env)) env)))
-(make-binary-primitive 'fx- (lambda (x y env) (binop (cc (binop x '- y env)) '+ (cc fxtag) env)))
+(make-unary-primitive 'pair? (predicate (lambda (x) (list 'IS_PAIR (list x)))))
 
-(define (from-fixnum x env) (binop x '>> (cc fxshift) env))
-(define (to-fixnum x env) (binop (cc (binop x '<< (cc fxshift) env)) '+ (cc fxtag) env))
+(define (comparison op)
+  (lambda (x y env want)
+    (cons 'bool (list (compile-as x env 'scm) op (compile-as y env 'scm)))))
 
-(make-binary-primitive 'fx* (lambda (x y env)
-                              (to-fixnum (cc (binop (cc (from-fixnum x env))
-                                                    '*
-                                                    (cc (from-fixnum y env))
-                                                    env)))))
+;; tagging preserves the order of fixnums, as long as they are compared signed
+(define (fixnum-comparison op)
+  (lambda (x y env want)
+    (cons 'bool (list (list "(long)" (compile-as x env 'scm)) op (list "(long)" (compile-as y env 'scm))))))
 
-(make-binary-primitive 'fxlogand (pure-binop '&))
-(make-binary-primitive 'fxlogor (pure-binop "|"))
+(make-binary-primitive 'fx=  (comparison '==))
+(make-binary-primitive 'fx>  (fixnum-comparison '>))
+(make-binary-primitive 'fx>= (fixnum-comparison '>=))
+(make-binary-primitive 'fx<  (fixnum-comparison '<))
+(make-binary-primitive 'fx<= (fixnum-comparison '<=))
 
-(make-binary-primitive 'fx=  (compose to-bool (pure-binop '==)))
-(make-binary-primitive 'fx>  (compose to-bool (pure-binop '>)))
-(make-binary-primitive 'fx>= (compose to-bool (pure-binop '>=)))
-(make-binary-primitive 'fx<  (compose to-bool (pure-binop '<)))
-(make-binary-primitive 'fx<= (compose to-bool (pure-binop '<=)))
+(make-binary-primitive 'char=  (comparison '==))
+(make-binary-primitive 'char>  (comparison '>))
+(make-binary-primitive 'char>= (comparison '>=))
+(make-binary-primitive 'char<  (comparison '<))
+(make-binary-primitive 'char<= (comparison '<=))
 
-(make-binary-primitive 'char=  (compose to-bool (pure-binop '==)))
-(make-binary-primitive 'char>  (compose to-bool (pure-binop '>)))
-(make-binary-primitive 'char>= (compose to-bool (pure-binop '>=)))
-(make-binary-primitive 'char<  (compose to-bool (pure-binop '<)))
-(make-binary-primitive 'char<= (compose to-bool (pure-binop '<=)))
+(make-binary-primitive 'eq? (comparison '==))
+(make-binary-primitive 'eqv? (comparison '==))
 
 (make-unary-primitive 'string-length
-                      (lambda (x env)
-                        (to-fixnum
-                         (cc (list (list "(block*)" (compile-expr x env)) "->header >> headershift"))
-                         env)))
-
-(make-binary-primitive 'eq? (compose to-bool (pure-binop '==)))
-(make-binary-primitive 'eqv? (compose to-bool (pure-binop '==)))
+                      (lambda (x env want)
+                        (cons 'long (list (list "(block*)" (compile-as x env 'scm)) "->header >> headershift"))))
 
 (define (func f)
-  (lambda (args env) (list f (intercalate "," (map (lambda (arg) (compile-expr arg env)) args)))))
+  (lambda (args env want)
+    (cons 'scm (list f (intercalate "," (map (lambda (arg) (compile-expr arg env)) args))))))
 
 (make-primitive 'car (func "CAR") 1)
 (make-primitive 'cdr (func "CDR") 1)
 
 (make-primitive 'cons (func "cons") 2)
 
-(make-unary-primitive 'make-vector (lambda (x env)
-                                     (list "allocvector(" (from-fixnum x env) ")")))
+(make-unary-primitive 'make-vector (lambda (x env want)
+                                     (cons 'scm (list "allocvector(" (compile-as x env 'long) ")"))))
 
-(make-binary-primitive 'vector-ref (lambda (v i env)
-                                     (list "((block*)" (compile-expr v env) ")->data[" (from-fixnum i env) "]")))
+(make-binary-primitive 'vector-ref (lambda (v i env want)
+                                     (cons 'scm (list "((block*)" (compile-expr v env) ")->data[" (compile-as i env 'long) "]"))))
 
-(make-primitive 'vector (lambda (args env)
-                                (let ((tmp (new-tmp)))
+(make-primitive 'vector (lambda (args env want)
+                          (let ((slot (new-slot)))
+                            (cons 'scm
                                   (intercalate
                                    ","
                                    (cons
-                                    (list tmp "=" (compile-expr (list 'make-vector (length args)) env))
+                                    (list slot "=" (compile-expr (list 'make-vector (length args)) env))
                                     (append
-                                     (enumerate (lambda (i arg) (compile-expr (list 'set! (list 'vector-ref (cc tmp) i) arg) env)) args)
-                                     (list tmp)))))) '*)
-
-(make-unary-primitive 'vector-length (lambda (v env)
-                                       (to-fixnum
-                                        (cc (list 'VECTOR_LENGTH (list (compile-expr v env))))
-                                        env)))
-
-(make-unary-primitive 'pair? (lambda (x env)
-                               (to-bool (list 'IS_PAIR (list (compile-expr x env))))))
+                                     (enumerate (lambda (i arg) (compile-expr (list 'set! (list 'vector-ref (cc slot) i) arg) env)) args)
+                                     (list slot))))))) '*)
+
+(make-unary-primitive 'vector-length (lambda (v env want)
+                                       (cons 'long (list 'VECTOR_LENGTH (list (compile-expr v env))))))
+
+;; Generic arithmetic. Every number a compiled program has is a fixnum,
+;; so these are the fixnum primitives under other names. Calls with
+;; other than two arguments are desugared (see *variadic-primitives*).
+
+(define (alias-primitive name primitive)
+  (set! *primitives* (cons (cons name (assq-ref primitive *primitives*)) *primitives*)))
+
+(alias-primitive '+ 'fx+)
+(alias-primitive '- 'fx-)
+(alias-primitive '* 'fx*)
+(alias-primitive '= 'fx=)
+(alias-primitive 'number? 'fixnum?)
+(alias-primitive 'char->integer 'char->fixnum)
+
+;; symbols are ordered by name (see compare in runtime.h)
+(define (generic-comparison op)
+  (lambda (x y env want)
+    (cons 'bool (list (list 'compare (list (compile-as x env 'scm) "," (compile-as y env 'scm))) op 0))))
+
+(make-binary-primitive '<  (generic-comparison '<))
+(make-binary-primitive '<= (generic-comparison '<=))
+(make-binary-primitive '>  (generic-comparison '>))
+(make-binary-primitive '>= (generic-comparison '>=))
+
+;; shifted unsigned, so that shifting a negative number is defined
+(make-binary-primitive 'lsh (lambda (x y env want)
+                              (cons 'long (list "(long)"
+                                                (list (list "(unsigned long)" (compile-as x env 'long))
+                                                      '<<
+                                                      (compile-as y env 'long))))))
+
+;; strings, symbols and lists
+
+(make-unary-primitive 'string? (predicate (lambda (x) (list 'IS_STRING (list x)))))
+(make-unary-primitive 'symbol? (predicate (lambda (x) (list 'IS_SYMBOL (list x)))))
+
+(make-primitive 'string-append (func "string_append") 2)
+(make-primitive 'number->string (func "number_to_string") 1)
+(make-primitive 'string->number (func "string_to_number") 1)
+(make-primitive 'symbol->string (func "symbol_to_string") 1)
+(make-primitive 'string->symbol (func "string_to_symbol") 1)
+
+(make-unary-primitive 'length (lambda (x env want)
+                                (cons 'long (list "list_length" (list (compile-expr x env))))))
+
+;; Calls with arguments between the procedure and the list have them
+;; consed onto it (see *variadic-primitives*). A procedure of fixed arity
+;; is called through the runtime's pending tail call, so it may be given
+;; at most MAX_TAIL_ARGS - 1 arguments; more is a runtime error, which
+;; variadic procedures do not have.
+(make-primitive 'apply (func "apply") 2)
+
+;; ports and output
+
+(make-primitive 'open-input-file (func "open_input_file") 1)
+(make-primitive 'close-port (func "close_port") 1)
+(make-primitive 'read (func "read_datum") 1)
+(make-primitive 'eof-object (lambda (args env want) (cons 'scm eof)) 0)
+(make-unary-primitive 'eof-object? (predicate (lambda (x) (list x '== eof))))
+
+(make-primitive 'display (func "display") 1)
+(make-primitive 'write (func "write") 1)
+(make-primitive 'write-char (func "write_char") 1)
+
+;; the arguments are passed as an array, since there may be any number
+(make-primitive 'error (lambda (args env want)
+                         (cons 'scm (append (list "scm_error(" (length args) ",(scm[]){")
+                                            (append (intercalate "," (map (lambda (arg) (compile-expr arg env)) args))
+                                                    (list "})")))))
+                '*)
+
+;; the list of the program's command line arguments, starting with its
+;; name, which a program with main is called with
+(make-primitive 'command-line (lambda (args env want) (cons 'scm "command_line")) 0)
 
 ;; compile primitive procedures
 
@@ -199,8 +376,20 @@
 (define (primcall? x)
   (and (pair? x) (primitive? (car x))))
 
-(define (compile-primcall x env)
-  ((car (assq-ref (car x) *primitives*)) (cdr x) env))
+(define (compile-primcall x env want)
+  (compile-staged (cdr x) env
+                  (lambda (args)
+                    (let ((result ((car (assq-ref (car x) *primitives*)) args env want)))
+                      (convert (cdr result) (car result) want)))))
+
+;; primitives which allocate on the heap
+(define *allocating-primitives*
+  '(cons make-vector vector string-append number->string symbol->string apply open-input-file read))
+
+;; primitives with side effects, which may be neither dropped nor
+;; reordered
+(define *effectful-primitives*
+  '(apply open-input-file close-port read display write write-char error))
 
 ;; compile if
 
@@ -208,13 +397,10 @@
   (lambda (x)
     (and (pair? x) (eq? tag (car x)))))
 
-(define (from-bool x env)
-  (binop x '!= (cc f) env))
-
 (define if? (tagged-pair? 'if))
 
 (define (compile-if x env)
-  (list (from-bool (cadr x) env)
+  (list (compile-as (cadr x) env 'bool)
         '? (compile-expr (caddr x) env)
         ': (compile-expr (cadddr x) env)))
 
@@ -241,8 +427,19 @@
 
 (define set!? (tagged-pair? 'set!))
 
+(define vector-ref? (tagged-pair? 'vector-ref))
+
+;; stores into the heap go through the write barrier
 (define (compile-set! x env)
-  (binop (cadr x) '= (caddr x) env))
+  (if (vector-ref? (cadr x))
+      (compile-staged (append (cdadr x) (cddr x)) env
+                      (lambda (args)
+                        (list "vector_set" (list (compile-expr (car args) env)
+                                                 ","
+                                                 (compile-as (cadr args) env 'long)
+                                                 ","
+                                                 (compile-expr (caddr args) env)))))
+      (binop (cadr x) '= (caddr x) env)))
 
 ;; compile lambdas
 
@@ -253,43 +450,213 @@
 (define (uniq-var prefix)
   (string-append prefix (number->string (uniq-id))))
 
-(define *lambdas* '())
-
 (define lambda? (tagged-pair? 'lambda))
 
-(define (compile-lambda x env)
-  (let ((formals (cadr x))
-        (body (cddr x)))
-    (let ((lambda-name (uniq-var "l"))
-          (formal-pairs (map (lambda (f) (cons f (uniq-var "v"))) formals)))
-      (let ((new-env (extend env formal-pairs)))
-        (set! *lambdas* (cons
-                         (list lambda-name (map cdr formal-pairs) (compile-begin-expr body new-env))
-                         *lambdas*))
-        lambda-name))))
+;; The formals of a variadic lambda end in a variable which is bound to
+;; the list of the rest of its arguments. Once desugared, such a lambda
+;; has no other formals, or only its closure after closure conversion.
+(define (lambda-vars formals)
+  (cond
+   ((null? formals) '())
+   ((symbol? formals) (list formals))
+   (else (cons (car formals) (lambda-vars (cdr formals))))))
+
+(define (variadic? x)
+  (not (list? (cadr x))))
+
+;; Every live value of a C function is kept in its array of slots s[],
+;; which is linked into the runtime's shadow stack so the garbage
+;; collector can find and update it. Formals occupy the first slots.
+
+(define *slots* 0)
+
+(define (new-slot)
+  (let ((n *slots*))
+    (set! *slots* (+ n 1))
+    (string-append "s[" (number->string n) "]")))
+
+;; A lambda has been closure converted, so its body refers only to its
+;; formals. It is given a name when its calls are known (see fix); a
+;; closure's first formal is the closure itself. A variadic lambda's
+;; last formal is the list of its arguments. Its C function is written
+;; out as soon as it is compiled, before the function containing it, so
+;; only the code of the functions being compiled is held at once.
+
+(define (compile-lambda x name closure)
+  (let ((formals (lambda-vars (cadr x)))
+        (body (cddr x))
+        (outer-slots *slots*)
+        (outer-function *function*)
+        (outer-loops *loops*))
+    (set! *slots* 0)
+    (set! *loops* #f)
+    (let ((lambda-name (if name name (uniq-var "l")))
+          (params (map (lambda (f) (uniq-var "v")) formals))
+          (formal-pairs (map (lambda (f) (cons f (new-slot))) formals))
+          (outer-source-name *source-name*))
+      (set! *function* (list lambda-name (length formals) closure))
+      (if closure
+          (add-census-lambda lambda-name (cdr (cadr x))))
+      (if (lambda-source lambda-name)
+          (set! *source-name* (lambda-source lambda-name)))
+      (let ((new-env (extend formal-pairs (empty-env))))
+        (let ((code (compile-tail-begin body new-env)))
+          (emit-function lambda-name params *slots* *loops* code)
+          (set! *slots* outer-slots)
+          (set! *function* outer-function)
+          (set! *loops* outer-loops)
+          (set! *source-name* outer-source-name)
+          lambda-name)))))
+
+;; The allocation census (see runtime.c) attributes each closure to the
+;; lambda it was made from, which is described by the variable it is
+;; bound to if it is a known function, or else by its formals and the
+;; nearest enclosing known function.
+
+;; the variable each known function's C name was made for (see fix)
+(define *lambda-sources* '())
+
+(define (lambda-source name)
+  (assq-ref (string->symbol name) *lambda-sources*))
+
+;; the variable of the innermost known function being compiled
+(define *source-name* #f)
+
+;; C names of closures' functions with their descriptions, last first
+(define *census-lambdas* '())
+
+(define (add-census-lambda name formals)
+  (let ((source-name (lambda-source name)))
+    (set! *census-lambdas*
+          (cons (cons name
+                      (cond
+                       (source-name (symbol->string source-name))
+                       (*source-name* (string-append (lambda-description formals)
+                                                     (string-append " in " (symbol->string *source-name*))))
+                       (else (lambda-description formals))))
+                *census-lambdas*))))
+
+(define (lambda-description formals)
+  (string-append "(lambda "
+                 (string-append (if (symbol? formals)
+                                    (symbol->string formals)
+                                    (string-append "("
+                                                   (string-append (reduce (lambda (s acc) (string-append acc s))
+                                                                          (intercalate " " (map symbol->string formals))
+                                                                          "")
+                                                                  ")")))
+                                ")")))
 
 (define closure? (tagged-pair? 'closure))
 
-(define *tmps* '())
-
-(define (new-tmp)
-  (let ((tmp (string->symbol (uniq-var "t"))))
-    (set! *tmps* (cons tmp *tmps*))
-    tmp))
-
+;; closures are allocated in the nursery, so their free variables are
+;; stored without a write barrier
 (define (compile-closure x env)
   (let ((l (cadr x))
         (fvs (caddr x)))
-    (let ((lambda-name (compile-lambda l env)))
-      (let ((alloc-expr (string-append "allocclosure(&" lambda-name "," (number->string (length fvs)) ")"))
-            (tmp (new-tmp)))
+    (let ((lambda-name (compile-lambda l (closure-name x) #t)))
+      (let ((alloc-expr (string-append (if (variadic? l) "allocvariadic(&" "allocclosure(&")
+                                       lambda-name "," (number->string (length fvs)) ")")))
         (if (= 0 (length fvs))
             alloc-expr
-            (intercalate
-             ","
-             (append (list (list tmp "=" alloc-expr))
-                     (append (enumerate (lambda (i fv) (binop (list 'env-get (cc tmp) i) '= fv env)) fvs)
-                             (list tmp)))))))))
+            (let ((slot (new-slot)))
+              (intercalate
+               ","
+               (append (list (list slot "=" alloc-expr))
+                       (append (enumerate (lambda (i fv) (binop (list 'env-get (cc slot) i) '= fv env)) fvs)
+                               (list slot))))))))))
+
+(define (closure-name x)
+  (if (null? (cdddr x)) #f (cadddr x)))
+
+;; fix binds known functions (see closure-convert). Their closures are
+;; all allocated before any free variables are filled in, so that they
+;; can refer to each other. Filling in happens after later allocations,
+;; which may have promoted a closure, so it goes through the write
+;; barrier. A function with no closure is only compiled.
+
+(define fix? (tagged-pair? 'fix))
+
+(define code? (tagged-pair? 'code))
+
+;; the bindings of functions which have closures
+(define (fix-closures bindings)
+  (cond
+   ((null? bindings) '())
+   ((closure? (cadar bindings)) (cons (car bindings) (fix-closures (cdr bindings))))
+   (else (fix-closures (cdr bindings)))))
+
+(define (compile-code x)
+  (compile-lambda (cadr x) (caddr x) #f))
+
+(define (compile-fix-alloc c slot)
+  (list slot "=allocclosure(&" (compile-lambda (cadr c) (closure-name c) #t) "," (length (caddr c)) ")"))
+
+(define (compile-fix-fills c slot env)
+  (enumerate (lambda (i fv)
+               (list "vector_set" (list slot "," (+ i 1) "," (compile-expr fv env))))
+             (caddr c)))
+
+;; the expressions which bind x's functions, and the environment of its
+;; body. The functions may call each other, so they are declared first.
+(define (compile-fix-bindings x env)
+  (let ((closures (fix-closures (cadr x))))
+    (for-each (lambda (binding)
+                (let ((f (cadr binding)))
+                  (if (code? f)
+                      (emit-function-declaration (caddr f) (cadr (cadr f)))
+                      (emit-function-declaration (closure-name f) (cadr (cadr f))))))
+              (cadr x))
+    (for-each (lambda (binding)
+                (if (code? (cadr binding))
+                    (compile-code (cadr binding))))
+              (cadr x))
+    (let ((slots (map (lambda (binding) (new-slot)) closures)))
+      (let ((new-env (extend (map2 (lambda (binding slot) (cons (car binding) slot)) closures slots)
+                             env)))
+        (cons (append (map2 (lambda (binding slot) (compile-fix-alloc (cadr binding) slot))
+                            closures slots)
+                      (reduce (lambda (fills acc) (append acc fills))
+                              (map2 (lambda (binding slot) (compile-fix-fills (cadr binding) slot new-env))
+                                    closures slots)
+                              '()))
+              new-env)))))
+
+(define (compile-fix x env)
+  (let ((bindings (compile-fix-bindings x env)))
+    (intercalate "," (append (car bindings) (list (compile-begin-expr (cddr x) (cdr bindings)))))))
+
+(define (compile-tail-fix x env)
+  (let ((bindings (compile-fix-bindings x env)))
+    (append (compile-statements (car bindings))
+            (compile-tail-begin (cddr x) (cdr bindings)))))
+
+;; a call to a known function, by the name of its C function
+(define direct? (tagged-pair? 'direct))
+
+(define (compile-direct x env)
+  (compile-staged (cddr x) env
+                  (lambda (args)
+                    (list "run_tail_calls"
+                          (list (cadr x)
+                                (intercalate "," (map (lambda (arg) (compile-expr arg env)) args)))))))
+
+;; let stores each value in a fresh slot
+(define (compile-let-bindings x env)
+  (let ((slots (map (lambda (binding) (new-slot)) (cadr x))))
+    (cons (map2 (lambda (binding slot) (list slot "=" (compile-expr (cadr binding) env)))
+                (cadr x) slots)
+          (extend (map2 (lambda (binding slot) (cons (car binding) slot)) (cadr x) slots)
+                  env))))
+
+(define (compile-let x env)
+  (let ((bindings (compile-let-bindings x env)))
+    (intercalate "," (append (car bindings) (list (compile-begin-expr (cddr x) (cdr bindings)))))))
+
+(define (compile-tail-let x env)
+  (let ((bindings (compile-let-bindings x env)))
+    (append (compile-statements (car bindings))
+            (compile-tail-begin (cddr x) (cdr bindings)))))
 
 (define env-get? (tagged-pair? 'env-get))
 
@@ -312,14 +679,68 @@
 
 (define app? pair?)
 
+(define (function-type n)
+  (define (params n)
+    (if (= n 1) "scm" (string-append "scm," (params (- n 1)))))
+  (string-append "scm(*)(" (params n) ")"))
+
+(define (closure-function proc n)
+  (list (list (function-type n))
+        (list (list "(block*)" proc) "->data[0]")))
+
+;; A callee may hand back a pending tail call, which is made here. CALL
+;; checks whether the closure is variadic.
 (define (compile-app x env)
-  (let ((tmp (new-tmp)))
-    (let ((proc (compile-expr (car x) env))
-          (args (cons tmp (map (lambda (arg) (compile-expr arg env)) (cdr x)))))
-      (intercalate "," (list (list tmp "=" proc)
-                             (list (list (list "scm(*)" (intercalate "," (map (const "scm") args)))
-                                         (list (list "(block*)" (list tmp)) "->data[0]"))
-                                   (intercalate "," args)))))))
+  (compile-staged x env
+                  (lambda (x)
+                    (let ((proc (compile-expr (car x) env)))
+                      (let ((args (cons proc (map (lambda (arg) (compile-expr arg env)) (cdr x)))))
+                        (list "run_tail_calls"
+                              (append (list "CALL(" (function-type (length args)) "," (length args) ",")
+                                      (append (intercalate "," args) (list ")")))))))))
+
+;; Expressions which neither allocate nor have side effects, so they may
+;; be evaluated in any order.
+
+(define (simple? x)
+  (cond
+   ((cc? x) #t)
+   ((imm? x) #t)
+   ((string? x) #t)
+   ((var? x) #t)
+   ((quote? x) #t)
+   ((env-get? x) #t)
+   ((primcall? x) (and (not (memq (car x) *allocating-primitives*))
+                       (not (memq (car x) *effectful-primitives*))
+                       (all-simple? (cdr x))))
+   (else #f)))
+
+(define (all-simple? xs)
+  (or (null? xs)
+      (and (simple? (car xs)) (all-simple? (cdr xs)))))
+
+;; Arguments which are not simple are evaluated left to right into fresh
+;; slots before k compiles the expression that uses them, so no heap
+;; pointer is held in a C temporary while another argument allocates.
+
+(define (stage args env)
+  (let ((staged (map (lambda (arg)
+                       (if (simple? arg)
+                           (cons '() arg)
+                           (let ((slot (new-slot)))
+                             (cons (list (list slot "=" (compile-expr arg env)))
+                                   (cc slot)))))
+                     args)))
+    (cons (reduce (lambda (p acc) (append acc p)) (map car staged) '())
+          (map cdr staged))))
+
+(define (compile-staged args env k)
+  (let ((staged (stage args env)))
+    (let ((preludes (car staged))
+          (expr (k (cdr staged))))
+      (if (null? preludes)
+          expr
+          (intercalate "," (append preludes (list expr)))))))
 
 ;; quote
 
@@ -359,18 +780,147 @@
    ;; closures
    ((closure? x) (compile-closure x env))
    ((env-get? x) (compile-env-get x env))
+   ((fix? x) (compile-fix x env))
+   ((direct? x) (compile-direct x env))
+   ((let? x) (compile-let x env))
 
    ;; primitive calls
-   ((primcall? x) (compile-primcall x env))
+   ((primcall? x) (compile-primcall x env 'scm))
 
    ;; function application
    ((app? x) (compile-app x env))
 
    (else (error "cannot compile expr" x))))
 
+;; Tail position
+
+;; The body of a function is compiled to C statements, so that calls in
+;; tail position can return without growing the C stack. A call which
+;; may be to the function itself checks, and if so reassigns its slots
+;; and jumps back to the top. Any other tail call pops the frame first
+;; and is made with musttail where the C compiler supports it and the
+;; signatures match; otherwise it is handed back to the nearest
+;; non-tail call site as a pending call (see run_tail_calls).
+
+;; the name and number of parameters of the function being compiled, and
+;; whether it is called through a closure
+(define *function* (list "scheme" 0 #f))
+
+(define function-name car)
+(define function-arity cadr)
+(define function-closure? caddr)
+
+;; whether it jumps back to its top
+(define *loops* #f)
+
+;; must match MAX_TAIL_ARGS in runtime.h
+(define max-tail-args 8)
+
+;; Statements are flat lists of C fragments. The symbol leave-frame
+;; stands for popping the frame, if the function has one.
+
+(define (compile-return expr)
+  (list "{\nscm r = " expr ";\n" 'leave-frame "return r;\n}\n"))
+
+(define (compile-tail x env)
+  (cond
+   ((if? x) (compile-tail-if x env))
+   ((begin? x) (compile-tail-begin (cdr x) env))
+   ((fix? x) (compile-tail-fix x env))
+   ((let? x) (compile-tail-let x env))
+   ((direct? x) (compile-tail-direct x env))
+   ((or (not (app? x)) (cc? x) (quote? x) (set!? x) (closure? x) (env-get? x) (primcall? x))
+    (compile-return (compile-expr x env)))
+   (else (compile-tail-app x env))))
+
+(define (compile-tail-if x env)
+  (append (list "if (" (compile-as (cadr x) env 'bool) ") {\n")
+          (append (compile-tail (caddr x) env)
+                  (append (list "} else {\n")
+                          (append (compile-tail (cadddr x) env)
+                                  (list "}\n"))))))
+
+(define (compile-tail-begin xs env)
+  (if (null? (cdr xs))
+      (compile-tail (car xs) env)
+      (append (list (compile-expr (car xs) env) ";\n")
+              (compile-tail-begin (cdr xs) env))))
+
+(define (compile-statements exprs)
+  (reduce (lambda (expr acc) (append acc (list expr ";\n"))) exprs '()))
+
+(define (tail-temp i)
+  (string-append "k" (number->string i)))
+
+(define (compile-tail-app x env)
+  (let ((staged (stage x env)))
+    (append (compile-statements (car staged))
+            (compile-tail-call (closure-function (tail-temp 0) (length x))
+                               (map (lambda (arg) (compile-expr arg env)) (cdr staged))
+                               (if (function-closure? *function*) 'maybe #f)
+                               #t))))
+
+(define (compile-tail-direct x env)
+  (let ((staged (stage (cddr x) env)))
+    (append (compile-statements (car staged))
+            (compile-tail-call (cadr x)
+                               (map (lambda (arg) (compile-expr arg env)) (cdr staged))
+                               (eq? (cadr x) (function-name *function*))
+                               #f))))
+
+;; Call the C function fn on vals, which are simple. self is #t when the
+;; callee is known to be the function being compiled, and maybe when it
+;; could be, depending on the closure in the first value. An unknown
+;; callee may be variadic, which is checked before anything else.
+(define (compile-tail-call fn vals self unknown)
+  (let ((n (length vals))
+        (temps (enumerate (lambda (i val) (tail-temp i)) vals)))
+    (let ((decls (reduce (lambda (decl acc) (append acc decl))
+                         (map2 (lambda (temp val) (list "scm " temp " = " val ";\n")) temps vals)
+                         '()))
+          (args (intercalate ", " temps)))
+      (append (cons "{\n" (append decls (if unknown (compile-variadic-tail-call temps) '())))
+              (append (compile-self-tail-call temps self)
+                      (if (eq? self #t)
+                          (list "}\n")
+                          (cons 'leave-frame
+                                (append
+                                 (cond
+                                  ((< max-tail-args n)
+                                   (list "return run_tail_calls(" fn args ");\n"))
+                                  ((= n (function-arity *function*))
+                                   (append (list "TAIL_CALL(" fn ", " n ", ") (append args (list ");\n"))))
+                                  (else
+                                   (append (list "return DEFER_CALL(" fn ", " n ", ") (append args (list ");\n")))))
+                                 (list "}\n")))))))))
+
+(define (compile-variadic-tail-call temps)
+  (append (list "if (IS_VARIADIC(k0)) {\n" 'leave-frame "return call_variadic(" (length temps) ", (scm[]){")
+          (append (intercalate ", " temps) (list "});\n}\n"))))
+
+(define (compile-self-tail-call temps self)
+  (let ((jump (append (enumerate (lambda (i temp) (string-append "s[" (number->string i) "] = " temp ";\n"))
+                                 temps)
+                      (list "goto top;\n"))))
+    (cond
+     ((eq? self #t)
+      (set! *loops* #t)
+      jump)
+     ((and self (= (length temps) (function-arity *function*)))
+      (set! *loops* #t)
+      (append (list "if (((block*)k0)->data[0] == (scm)&" (function-name *function*) ") {\n")
+              (append jump (list "}\n"))))
+     (else '()))))
+
 ;; Closure conversion, following the approach outlined in
 ;; http://matt.might.net/articles/compiling-scheme-to-c/
 
+(define (fix-vars x)
+  (map car (cadr x)))
+
+(define (fix-vals x)
+  (map cadr (cadr x)))
+
 (define (free-vars x)
   (cond
    ;; constants
@@ -382,20 +932,27 @@
    ;; special forms
    ((quote? x) '())
    ((set!? x) (set-union (free-vars (cadr x)) (free-vars (caddr x))))
-   ((if? x) (reduce set-union (map free-vars (cdr x)) '()))
-   ((begin? x) (reduce set-union (map free-vars (cdr x)) '()))
-   ((lambda? x) (set-difference (reduce set-union (map free-vars (cddr x)) '())
-                                (list->set (cadr x))))
-
-   ;; closures
-   ((closure? x) (set-union (free-vars (cadr x)) (free-vars (caddr x))))
+   ((if? x) (set-union-all (map free-vars (cdr x))))
+   ((begin? x) (set-union-all (map free-vars (cdr x))))
+   ((lambda? x) (set-difference (set-union-all (map free-vars (cddr x)))
+                                (list->set (lambda-vars (cadr x)))))
+   ((fix? x) (set-difference (set-union-all (map free-vars (append (fix-vals x) (cddr x))))
+                             (list->set (fix-vars x))))
+   ((let? x) (set-union (set-union-all (map free-vars (let-vals x)))
+                        (set-difference (set-union-all (map free-vars (cddr x)))
+                                        (list->set (let-vars x)))))
+
+   ;; closures, whose lambdas refer only to their formals
+   ((closure? x) (caddr x))
+   ((code? x) '())
    ((env-get? x) '())
+   ((direct? x) (set-union-all (map free-vars (cddr x))))
 
    ;; primitive calls
-   ((primcall? x) (reduce set-union (map free-vars (cdr x)) '()))
+   ((primcall? x) (set-union-all (map free-vars (cdr x))))
 
    ;; function application
-   ((app? x) (reduce set-union (map free-vars x) '()))
+   ((app? x) (set-union-all (map free-vars x)))
 
    (else (error "cannot find free vars of expr" x))))
 
@@ -414,11 +971,22 @@
    ((set!? x) (cons 'set! (map subber (cdr x))))
    ((if? x) (cons 'if (map subber (cdr x))))
    ((begin? x) (cons 'begin (map subber (cdr x))))
-   ((lambda? x) (append (list 'lambda (cadr x)) (map subber (cddr x))))
+   ((lambda? x) (let ((inner (without-vars dict (lambda-vars (cadr x)))))
+                  (append (list 'lambda (cadr x)) (map (lambda (e) (sub-vars e inner)) (cddr x)))))
+   ((fix? x) (let ((inner (without-vars dict (fix-vars x))))
+               (cons 'fix (cons (map (lambda (binding) (list (car binding) (sub-vars (cadr binding) inner)))
+                                     (cadr x))
+                                (map (lambda (e) (sub-vars e inner)) (cddr x))))))
+   ((let? x) (let ((inner (without-vars dict (let-vars x))))
+               (cons 'let (cons (map (lambda (binding) (list (car binding) (subber (cadr binding))))
+                                     (cadr x))
+                                (map (lambda (e) (sub-vars e inner)) (cddr x))))))
 
    ;; closures
-   ((closure? x) (list 'closure (sub-vars (cadr x) dict) (map subber (caddr x))))
+   ((closure? x) (cons 'closure (cons (cadr x) (cons (map subber (caddr x)) (cdddr x)))))
+   ((code? x) x)
    ((env-get? x) x)
+   ((direct? x) (cons 'direct (cons (cadr x) (map subber (cddr x)))))
 
    ;; primitive calls
    ((primcall? x) (cons (car x) (map subber (cdr x))))
@@ -428,7 +996,25 @@
 
    (else (error "cannot substitute variables in expr" x))))
 
-(define (closure-convert x)
+(define (without-vars alist vars)
+  (cond
+   ((null? alist) '())
+   ((memq (caar alist) vars) (without-vars (cdr alist) vars))
+   (else (cons (car alist) (without-vars (cdr alist) vars)))))
+
+;; Known functions are those bound by fix. A call to one with the right
+;; number of arguments becomes a direct call to its C function, passing
+;; its closure first if it has one. known is a tree mapping each function
+;; in scope to the name of its C function, the variable holding its
+;; closure (#f if it has none) and its number of formals, and each other
+;; variable in scope to #f.
+
+(define (known-name f) (car f))
+(define (known-closure f) (cadr f))
+(define (known-arity f) (caddr f))
+
+(define (closure-convert x known)
+  (define (convert e) (closure-convert e known))
   (cond
    ;; constants
    ((const? x) x)
@@ -438,29 +1024,166 @@
 
    ;; special forms
    ((quote? x) x)
-   ((set!? x) (list 'set! (cadr x) (closure-convert (caddr x))))
-   ((if? x) (cons 'if (map closure-convert (cdr x))))
-   ((begin? x) (cons 'begin (map closure-convert (cdr x))))
-   ((lambda? x)
-    (let ((formals (cadr x))
-          (body (map closure-convert (cddr x))))
-      (let ((fvs (set-difference (free-vars body) (free-vars formals))))
-        (let ((closure-env (string->symbol (uniq-var "e"))))
-          (let ((dict (enumerate (lambda (i fv) (cons fv (list 'env-get closure-env i))) fvs)))
-            (list 'closure
-                  (append (list 'lambda (cons closure-env formals)) (map (lambda (e) (sub-vars e dict)) body))
-                  fvs))))))
+   ((set!? x) (list 'set! (cadr x) (convert (caddr x))))
+   ((if? x) (cons 'if (map convert (cdr x))))
+   ((begin? x) (cons 'begin (map convert (cdr x))))
+   ((lambda? x) (closure-convert-lambda x known))
+   ((fix? x) (closure-convert-fix x known))
+   ((let? x) (cons 'let (cons (map (lambda (binding) (list (car binding) (convert (cadr binding))))
+                                   (cadr x))
+                              (map (lambda (e) (closure-convert e (tree-set-all (let-vars x) #f known)))
+                                   (cddr x)))))
 
    ;; primitive calls
-   ((primcall? x) (cons (car x) (map closure-convert (cdr x))))
+   ((primcall? x) (cons (car x) (map convert (cdr x))))
 
    ;; function application
-   ((app? x) (map closure-convert x))
+   ((known-call? x known)
+    (let ((f (tree-ref (car x) known)))
+      (append (list 'direct (known-name f))
+              (append (if (known-closure f) (list (known-closure f)) '())
+                      (map convert (cdr x))))))
+   ((app? x) (map convert x))
 
    (else (error "cannot closure convert expr" x))))
 
+(define (known-call? x known)
+  (and (var? (car x))
+       (let ((f (tree-ref (car x) known)))
+         (and f (= (length (cdr x)) (known-arity f))))))
+
+(define (closure-convert-lambda x known)
+  (closure-convert-closure x (tree-set-all (lambda-vars (cadr x)) #f known) (string->symbol (uniq-var "e"))))
+
+;; x's body is converted with known in scope, and closure-env naming its closure
+(define (closure-convert-closure x known closure-env)
+  (let ((formals (cadr x))
+        (body (map (lambda (e) (closure-convert e known)) (cddr x))))
+    (let ((fvs (set-difference (free-vars body) (list->set (lambda-vars (cons closure-env formals))))))
+      (let ((dict (enumerate (lambda (i fv) (cons fv (list 'env-get closure-env i))) fvs)))
+        (list 'closure
+              (append (list 'lambda (cons closure-env formals)) (map (lambda (e) (sub-vars e dict)) body))
+              fvs)))))
+
+;; A known function with a closure passes the closure it was called with
+;; to its own calls, rather than capturing itself. One without a closure
+;; becomes code, a lambda with no closure formal.
+(define (closure-convert-fix x known)
+  (let ((vars (fix-vars x))
+        (vals (fix-vals x)))
+    (let ((closureless (closureless-vars vars vals (cddr x)))
+          (names (map (lambda (var) (uniq-var "l")) vars)))
+      (let ((inner (reduce (lambda (binding known)
+                             (let ((var (car binding)) (name (cadr binding)) (val (caddr binding)))
+                               (tree-set var
+                                         (list name
+                                               (if (tree-ref var closureless) #f var)
+                                               (length (cadr val)))
+                                         known)))
+                           (map2 cons vars (map2 list names vals))
+                           known)))
+        (define (convert-binding var name val)
+          (set! *lambda-sources* (cons (cons (string->symbol name) var) *lambda-sources*))
+          (if (tree-ref var closureless)
+              (list 'code
+                    (cons 'lambda
+                          (cons (cadr val)
+                                (map (lambda (e) (closure-convert e (tree-set-all (cadr val) #f inner)))
+                                     (cddr val))))
+                    name)
+              (let ((closure-env (string->symbol (uniq-var "e")))
+                    (f (tree-ref var inner)))
+                (append (closure-convert-closure
+                         val
+                         (if (memq var (cadr val))
+                             (tree-set-all (cadr val) #f inner)
+                             (tree-set var
+                                       (list name closure-env (known-arity f))
+                                       (tree-set-all (cadr val) #f inner)))
+                         closure-env)
+                        (list name)))))
+        (cons 'fix
+              (cons (map2 (lambda (var name-val)
+                            (list var (convert-binding var (car name-val) (cdr name-val))))
+                          vars
+                          (map2 cons names vals))
+                    (map (lambda (e) (closure-convert e inner)) (cddr x))))))))
+
+;; The functions of a fix which need no closure, as a tree mapping each
+;; to #t: those which are only ever called directly, and whose free
+;; variables are all functions which need none. A function which needs a
+;; closure is a reason for each function referring to it to need one.
+(define (closureless-vars vars vals body)
+  (let ((arities (reduce (lambda (var-val arities)
+                           (tree-set (car var-val) (length (cadr (cdr var-val))) arities))
+                         (map2 cons vars vals)
+                         empty-tree))
+        (fvs (map free-vars vals)))
+    (let ((referrers (reduce (lambda (var-fv referrers)
+                               (reduce (lambda (fv referrers)
+                                         (tree-set fv (cons (car var-fv) (or (tree-ref fv referrers) '()))
+                                                   referrers))
+                                       (cdr var-fv)
+                                       referrers))
+                             (map2 cons vars fvs)
+                             empty-tree)))
+      (define (disqualify todo closured)
+        (cond
+         ((null? todo) closured)
+         ((tree-ref (car todo) closured) (disqualify (cdr todo) closured))
+         (else (disqualify (append (or (tree-ref (car todo) referrers) '()) (cdr todo))
+                           (tree-set (car todo) #t closured)))))
+      (let ((closured (disqualify (append (escaping-vars arities (append vals body))
+                                          (reduce (lambda (var-fv acc)
+                                                    (if (all? (lambda (fv) (tree-ref fv arities)) (cdr var-fv))
+                                                        acc
+                                                        (cons (car var-fv) acc)))
+                                                  (map2 cons vars fvs)
+                                                  '()))
+                                  empty-tree)))
+        (reduce (lambda (var closureless)
+                  (if (tree-ref var closured) closureless (tree-set var #t closureless)))
+                vars
+                empty-tree)))))
+
+;; The variables of arities which xs refer to other than by calling them
+;; with their number of arguments, found in a single walk. arities maps
+;; each variable in scope to its number of formals, and is #f for the
+;; variables which shadow one.
+(define (escaping-vars arities xs)
+  (define (walk x arities acc)
+    (cond
+     ((const? x) acc)
+     ((var? x) (if (tree-ref x arities) (cons x acc) acc))
+     ((quote? x) acc)
+     ((lambda? x) (walk-all (cddr x) (tree-set-all (lambda-vars (cadr x)) #f arities) acc))
+     ((fix? x) (walk-all (append (fix-vals x) (cddr x)) (tree-set-all (fix-vars x) #f arities) acc))
+     ((let? x) (walk-all (cddr x) (tree-set-all (let-vars x) #f arities) (walk-all (let-vals x) arities acc)))
+     ((primcall? x) (walk-all (cdr x) arities acc))
+     ((and (var? (car x)) (eq? (tree-ref (car x) arities) (length (cdr x)))) (walk-all (cdr x) arities acc))
+     (else (walk-all x arities acc))))
+  (define (walk-all xs arities acc)
+    (reduce (lambda (x acc) (walk x arities acc)) xs acc))
+  (walk-all xs arities '()))
+
 ;; Convert mutable variables
 
+;; A variable which is assigned and captured by a closure is kept in a
+;; box, a one element vector, so that the closure and its binder share
+;; it. One which is only assigned stays in its slot.
+
+(define (boxed-vars vars body)
+  (set-intersection (set-intersection (mutated-vars body) (captured-vars body))
+                    (list->set vars)))
+
+;; the free variables of the lambdas in x
+(define (captured-vars x)
+  (cond
+   ((quote? x) '())
+   ((lambda? x) (free-vars x))
+   ((pair? x) (set-union-all (map captured-vars x)))
+   (else '())))
+
 (define (mutated-vars x)
   (cond
    ;; constants
@@ -472,16 +1195,21 @@
    ;; special forms
    ((quote? x) '())
    ((set!? x) (list (cadr x)))
-   ((if? x) (reduce set-union (map mutated-vars (cdr x)) '()))
-   ((begin? x) (reduce set-union (map mutated-vars (cdr x)) '()))
-   ((lambda? x) (set-difference (reduce set-union (map mutated-vars (cddr x)) '())
-                                (list->set (cadr x))))
+   ((if? x) (set-union-all (map mutated-vars (cdr x))))
+   ((begin? x) (set-union-all (map mutated-vars (cdr x))))
+   ((lambda? x) (set-difference (set-union-all (map mutated-vars (cddr x)))
+                                (list->set (lambda-vars (cadr x)))))
+   ((fix? x) (set-difference (set-union-all (map mutated-vars (append (fix-vals x) (cddr x))))
+                             (list->set (fix-vars x))))
+   ((let? x) (set-union (set-union-all (map mutated-vars (let-vals x)))
+                        (set-difference (set-union-all (map mutated-vars (cddr x)))
+                                        (list->set (let-vars x)))))
 
    ;; primitive calls
-   ((primcall? x) (reduce set-union (map mutated-vars (cdr x)) '()))
+   ((primcall? x) (set-union-all (map mutated-vars (cdr x))))
 
    ;; function application
-   ((app? x) (reduce set-union (map mutated-vars x) '()))
+   ((app? x) (set-union-all (map mutated-vars x)))
 
    (else (error "cannot find mutated vars in expr" x))))
 
@@ -501,12 +1229,24 @@
    ((lambda? x)
     (let ((formals (cadr x))
           (body (map convert-mutable-vars (cddr x))))
-      (let ((mvs (set-intersection (mutated-vars body) (list->set formals))))
+      (let ((mvs (boxed-vars (lambda-vars formals) body)))
         (cons 'lambda
               (cons formals
                     (append
                      (map (lambda (mv) (list 'set! mv (list 'vector mv))) mvs)
                      (sub-vars body (map (lambda (mv) (cons mv (list 'vector-ref mv 0))) mvs))))))))
+   ((fix? x) (cons 'fix (cons (map (lambda (binding) (list (car binding) (convert-mutable-vars (cadr binding))))
+                                   (cadr x))
+                              (map convert-mutable-vars (cddr x)))))
+   ((let? x)
+    (let ((body (map convert-mutable-vars (cddr x))))
+      (let ((mvs (boxed-vars (let-vars x) body)))
+        (cons 'let
+              (cons (map (lambda (binding)
+                           (let ((val (convert-mutable-vars (cadr binding))))
+                             (list (car binding) (if (memq (car binding) mvs) (list 'vector val) val))))
+                         (cadr x))
+                    (sub-vars body (map (lambda (mv) (cons mv (list 'vector-ref mv 0))) mvs)))))))
 
    ;; primitive calls
    ((primcall? x) (cons (car x) (map convert-mutable-vars (cdr x))))
@@ -516,6 +1256,355 @@
 
    (else (error "cannot convert mutable vars in expr" x))))
 
+;; Optimization
+
+;; Runs after desugaring, before mutable variables are converted. Calls
+;; of primitives on constants are folded, an if on a constant keeps only
+;; the branch it takes, and an immediately applied lambda becomes a let,
+;; into whose body constants and unassigned variables are substituted.
+;; Procedures which are not recursive are inlined if they are at most
+;; *inline-size* nodes, until *inline-budget* nodes have been inlined in
+;; all. The levels -O0 to -O3 set these knobs.
+
+(define *optimize* #t)
+(define *inline-size* 16)
+(define *inline-budget* 1000)
+
+(define *optimization-levels*
+  '((-O0 #f 0 0)
+    (-O1 #t 0 0)
+    (-O2 #t 16 1000)
+    (-O3 #t 64 10000)))
+
+(define (set-optimization-level! level)
+  (let ((settings (assq-ref level *optimization-levels*)))
+    (if (not settings)
+        (error "unknown option" level))
+    (set! *optimize* (car settings))
+    (set! *inline-size* (cadr settings))
+    (set! *inline-budget* (caddr settings))))
+
+;; what is left of *inline-budget* for the program being compiled
+(define *inline-fuel* 0)
+
+;; every variable assigned anywhere in the program, as a tree
+(define *assigned* empty-tree)
+
+(define (assigned-vars x)
+  (cond
+   ((quote? x) '())
+   ((set!? x) (set-union (if (var? (cadr x)) (list (cadr x)) '())
+                         (assigned-vars (caddr x))))
+   ((pair? x) (set-union-all (map assigned-vars x)))
+   (else '())))
+
+;; let binds local variables, which live in slots of the enclosing
+;; function. It is introduced here, so desugar never sees it.
+
+(define (let-vars x)
+  (map car (cadr x)))
+
+(define (let-vals x)
+  (map cadr (cadr x)))
+
+(define (size x)
+  (cond
+   ((quote? x) 1)
+   ((pair? x) (+ (size (car x)) (size (cdr x))))
+   ((null? x) 0)
+   (else 1)))
+
+;; Expressions which may be dropped if their value is not used
+(define (pure? x)
+  (cond
+   ((or (const? x) (var? x) (quote? x) (lambda? x)) #t)
+   ((primcall? x) (and (not (memq (car x) *effectful-primitives*))
+                       (all? pure? (cdr x))))
+   (else #f)))
+
+(define (constant? x)
+  (or (const? x) (quote? x) (lambda? x)))
+
+;; Constants which may be copied: strings and quoted pairs may not,
+;; as each one is a distinct object.
+(define (copyable? x)
+  (or (imm? x)
+      (and (quote? x) (or (symbol? (cadr x)) (null? (cadr x))))))
+
+;; A procedure is small enough to inline, and holds no constant which
+;; would be copied into a distinct object at each call site. Variadic
+;; procedures are not inlined.
+(define (inlinable? x)
+  (and (not (variadic? x))
+       (<= (size x) *inline-size*)
+       (not (holds-object? x))))
+
+(define (holds-object? x)
+  (cond
+   ((quote? x) (not (copyable? x)))
+   ((pair? x) (or (holds-object? (car x)) (holds-object? (cdr x))))
+   (else (string? x))))
+
+;; Primitives which are folded when their arguments are constants, with
+;; the test each argument must pass and the procedure computing the
+;; result. A result which is not a fixnum or a boolean is not folded.
+
+(define (any-constant x) #t)
+
+(define (eq-comparable? x)
+  (or (number? x) (boolean? x) (null? x) (symbol? x)))
+
+(define (fold-eq? x y)
+  (if (number? x)
+      (and (number? y) (= x y))
+      (eq? x y)))
+
+(define *foldable*
+  (list (list 'fxadd1 fixnum? (lambda (x) (+ x 1)))
+        (list 'fxsub1 fixnum? (lambda (x) (- x 1)))
+        (list 'fx+ fixnum? +)
+        (list 'fx- fixnum? -)
+        (list 'fx* fixnum? *)
+        (list 'fx= fixnum? =)
+        (list 'fx< fixnum? <)
+        (list 'fx<= fixnum? <=)
+        (list 'fx> fixnum? >)
+        (list 'fx>= fixnum? >=)
+        (list 'fxzero? fixnum? (lambda (x) (= x 0)))
+        (list 'not any-constant not)
+        (list 'null? any-constant null?)
+        (list 'pair? any-constant pair?)
+        (list 'fixnum? any-constant fixnum?)
+        (list 'boolean? any-constant boolean?)
+        (list 'eq? eq-comparable? fold-eq?)
+        (list 'eqv? eq-comparable? fold-eq?)))
+
+(define (constant-value x)
+  (if (quote? x) (cadr x) x))
+
+(define (fold x)
+  (let ((folder (assq-ref (car x) *foldable*)))
+    (if (and folder
+             (all? copyable? (cdr x))
+             (all? (car folder) (map constant-value (cdr x))))
+        (let ((result (apply (cadr folder) (map constant-value (cdr x)))))
+          (if (or (fixnum? result) (boolean? result))
+              result
+              x))
+        x)))
+
+;; An environment is a tree mapping each variable in scope to an entry.
+;; Each binding of a variable gets a fresh stamp, and its entry may hold
+;; an expression to substitute for the variable, (stamp subst expr deps),
+;; or a procedure to inline at its calls, (stamp inline lambda deps). deps
+;; pairs each variable the expression or procedure refers to with its
+;; stamp where the entry was made, and the entry is only used where those
+;; stamps are unchanged, so that nothing is captured. Other variables
+;; have entries (stamp bound).
+
+(define *stamp* 0)
+
+(define (new-stamp)
+  (set! *stamp* (+ *stamp* 1))
+  *stamp*)
+
+(define (entry-stamp entry) (car entry))
+(define (entry-kind entry) (cadr entry))
+(define (entry-value entry) (caddr entry))
+(define (entry-deps entry) (cadddr entry))
+
+(define (stamp-of var env)
+  (let ((entry (tree-ref var env)))
+    (and entry (entry-stamp entry))))
+
+(define (bind-vars vars env)
+  (reduce (lambda (var env) (tree-set var (list (new-stamp) 'bound) env)) vars env))
+
+(define (dependencies vars env)
+  (map (lambda (var) (cons var (stamp-of var env))) vars))
+
+;; the entry of var if it is of kind, and what it refers to is in scope
+(define (usable-entry var kind env)
+  (let ((entry (tree-ref var env)))
+    (and entry
+         (eq? (entry-kind entry) kind)
+         (all? (lambda (dep) (eq? (stamp-of (car dep) env) (cdr dep))) (entry-deps entry))
+         entry)))
+
+(define (assigned? var)
+  (tree-ref var *assigned*))
+
+(define (optimize x env)
+  (cond
+   ;; constants
+   ((const? x) x)
+
+   ;; variables
+   ((var? x) (let ((entry (usable-entry x 'subst env)))
+               (if entry (entry-value entry) x)))
+
+   ;; special forms
+   ((quote? x) x)
+   ((set!? x) (list 'set!
+                    (if (var? (cadr x)) (cadr x) (optimize (cadr x) env))
+                    (optimize (caddr x) env)))
+   ((if? x) (optimize-if x env))
+   ((begin? x) (optimize-body (cdr x) env))
+   ((lambda? x) (list 'lambda (cadr x) (optimize-body (cddr x) (bind-vars (lambda-vars (cadr x)) env))))
+   ((fix? x) (optimize-fix x env))
+
+   ;; primitive calls
+   ((primcall? x) (fold (cons (car x) (map (lambda (e) (optimize e env)) (cdr x)))))
+
+   ;; function application
+   ((app? x) (optimize-app (car x) (map (lambda (e) (optimize e env)) (cdr x)) env))
+
+   (else (error "cannot optimize expr" x))))
+
+(define (optimize-if x env)
+  (let ((test (optimize (cadr x) env)))
+    (if (constant? test)
+        (optimize (if (eq? (constant-value test) #f) (cadddr x) (caddr x)) env)
+        (cons 'if (cons test (map (lambda (e) (optimize e env)) (cddr x)))))))
+
+;; a sequence, without the expressions whose values are unused and
+;; which have no effect
+(define (optimize-body xs env)
+  (define (flatten xs)
+    (cond
+     ((null? xs) '())
+     ((begin? (car xs)) (append (cdar xs) (flatten (cdr xs))))
+     ((and (pure? (car xs)) (not (null? (cdr xs)))) (flatten (cdr xs)))
+     (else (cons (car xs) (flatten (cdr xs))))))
+  (let ((body (flatten (map (lambda (e) (optimize e env)) xs))))
+    (if (null? (cdr body))
+        (car body)
+        (cons 'begin body))))
+
+;; a call of f on args, which have been optimized
+(define (optimize-app f args env)
+  (let ((entry (and (var? f) (usable-entry f 'inline env))))
+    (cond
+     ((and entry
+           (= (length (cadr (entry-value entry))) (length args))
+           (<= (size (entry-value entry)) *inline-fuel*))
+      (set! *inline-fuel* (- *inline-fuel* (size (entry-value entry))))
+      (optimize-let (cadr (entry-value entry)) args (cddr (entry-value entry)) env))
+     ((and (lambda? f) (not (variadic? f)) (= (length (cadr f)) (length args)))
+      (optimize-let (cadr f) args (cddr f) env))
+     (else
+      ;; A variable bound to a variadic primitive is not replaced by the
+      ;; primitive's name where the call would then need desugaring.
+      (let ((g (optimize f env)))
+        (if (variadic-call? (cons g args))
+            (cons f args)
+            (cons g args)))))))
+
+;; Bind formals to args, which have been optimized, around body. A
+;; binding is dropped if its variable is no longer used after
+;; substitution, and its value has no effect.
+(define (optimize-let formals args body env)
+  (let ((body (optimize-body body (let-entries formals args env))))
+    (let ((used (free-vars body)))
+      (let ((bindings (filter (lambda (binding)
+                                (or (memq (car binding) used) (not (pure? (cadr binding)))))
+                              (map2 list formals args))))
+        (if (null? bindings)
+            body
+            (list 'let bindings body))))))
+
+;; what args refer to is looked up in env, where they are evaluated
+(define (let-entries formals args env)
+  (define (entry var val)
+    (cond
+     ((assigned? var) (list (new-stamp) 'bound))
+     ((copyable? val) (list (new-stamp) 'subst val '()))
+     ((and (var? val) (not (assigned? val)))
+      (list (new-stamp) 'subst val (dependencies (list val) env)))
+     ((and (lambda? val) (inlinable? val))
+      (list (new-stamp) 'inline val (dependencies (free-vars val) env)))
+     (else (list (new-stamp) 'bound))))
+  (reduce (lambda (var-val inner) (tree-set (car var-val) (entry (car var-val) (cdr var-val)) inner))
+          (map2 cons formals args)
+          env))
+
+;; Functions bound by fix may be inlined if they cannot reach themselves
+;; through calls to the others.
+(define (optimize-fix x env)
+  (let ((vars (fix-vars x))
+        (vals (fix-vals x)))
+    (let ((inner (fix-entries vars vals (bind-vars vars env))))
+      (let ((fix (make-fix (map2 (lambda (var val) (list var (optimize val inner))) vars vals)
+                           (list (optimize-body (cddr x) inner)))))
+        (if (fix? fix) fix (cadr fix))))))
+
+(define (fix-entries vars vals env)
+  (let ((fvs (map free-vars vals))
+        (bound (tree-set-all vars #t empty-tree)))
+    (let ((recursive (recursive-vars vars
+                                     (map (lambda (fv) (filter (lambda (v) (tree-ref v bound)) fv))
+                                          fvs))))
+      (reduce (lambda (binding env)
+                (let ((var (car binding)) (val (cadr binding)) (fv (caddr binding)))
+                  (if (and (inlinable? val) (not (tree-ref var recursive)))
+                      (tree-set var (list (stamp-of var env) 'inline val (dependencies fv env)) env)
+                      env)))
+              (map2 cons vars (map2 list vals fvs))
+              env))))
+
+;; The vertices of a graph which lie on a cycle, as a tree mapping each
+;; to #t. succs lists the successors of each of vars. Tarjan's algorithm
+;; finds the strongly connected components; a vertex is on a cycle if
+;; its component has other vertices, or it is its own successor.
+(define (recursive-vars vars succs)
+  (let ((graph (reduce (lambda (var-succ graph) (tree-set (car var-succ) (cdr var-succ) graph))
+                       (map2 cons vars succs)
+                       empty-tree))
+        (index empty-tree)
+        (low empty-tree)
+        (count 0)
+        (stack '())
+        (on-stack empty-tree)
+        (recursive empty-tree))
+    (define (lower! v n)
+      (if (< n (tree-ref v low))
+          (set! low (tree-set v n low))))
+    (define (pop-component v component)
+      (let ((w (car stack)))
+        (set! stack (cdr stack))
+        (set! on-stack (tree-set w #f on-stack))
+        (if (eq? w v)
+            (cons w component)
+            (pop-component v (cons w component)))))
+    (define (visit v)
+      (set! index (tree-set v count index))
+      (set! low (tree-set v count low))
+      (set! count (+ count 1))
+      (set! stack (cons v stack))
+      (set! on-stack (tree-set v #t on-stack))
+      (for-each (lambda (w)
+                  (cond
+                   ((not (tree-ref w index))
+                    (visit w)
+                    (lower! v (tree-ref w low)))
+                   ((tree-ref w on-stack)
+                    (lower! v (tree-ref w index)))))
+                (tree-ref v graph))
+      (if (= (tree-ref v low) (tree-ref v index))
+          (let ((component (pop-component v '())))
+            (if (or (not (null? (cdr component))) (memq v (tree-ref v graph)))
+                (set! recursive (tree-set-all component #t recursive))))))
+    (for-each (lambda (v) (if (not (tree-ref v index)) (visit v))) vars)
+    recursive))
+
+(define (optimize-program x)
+  (if *optimize*
+      (begin
+        (set! *assigned* (tree-set-all (assigned-vars x) #t empty-tree))
+        (set! *inline-fuel* *inline-budget*)
+        (optimize x empty-tree))
+      x))
+
 ;; Remove syntactic sugar
 
 (define let? (tagged-pair? 'let))
@@ -523,7 +1612,7 @@
 (define (let->lambda x)
   (let ((vars (map car (cadr x)))
         (vals (map cadr (cadr x)))
-        (body (map desugar (cddr x))))
+        (body (cddr x)))
     (append (list (append (list 'lambda vars) body)) vals)))
 
 (define letrec? (tagged-pair? 'letrec))
@@ -533,22 +1622,254 @@
       '()
       (cons (f (car xs) (car ys)) (map2 f (cdr xs) (cdr ys)))))
 
-(define (letrec->letset! x)
+(define (filter p xs)
+  (cond
+   ((null? xs) '())
+   ((p (car xs)) (cons (car xs) (filter p (cdr xs))))
+   (else (filter p (cdr xs)))))
+
+(define (all? p xs)
+  (or (null? xs)
+      (and (p (car xs)) (all? p (cdr xs)))))
+
+(define (any? p xs)
+  (and (not (null? xs))
+       (or (p (car xs)) (any? p (cdr xs)))))
+
+;; A letrec's bindings are classified as in "Fixing Letrec" (Waddell,
+;; Sarkar and Dybvig). Lambdas bound to variables which are never
+;; assigned are bound by fix. Values which are pure and do not refer to
+;; the letrec's variables are simple, and bound by an enclosing let.
+;; The rest are complex: their variables are bound around the fix, so
+;; its functions can refer to them, and assigned in order inside it, and
+;; so are only boxed if a closure captures them.
+(define (letrec->fix x)
   (let ((vars (map car (cadr x)))
-        (vals (map cadr (cadr x)))
-        (body (map desugar (cddr x))))
-    (append (list 'let (map (lambda (var) (list var ''())) vars))
-            (append (map2 (lambda (var val) (list 'set! var val)) vars vals)
-                    body))))
+        (vals (map desugar (map cadr (cadr x))))
+        (body (desugar-body (cddr x))))
+    (let ((assigned (set-intersection (list->set vars)
+                                      (set-union-all (map mutated-vars (append vals body)))))
+          (bound (tree-set-all vars #t empty-tree))
+          (bindings (map2 list vars vals)))
+      (define (fixed-binding? binding)
+        (and (lambda? (cadr binding))
+             (not (variadic? (cadr binding)))
+             (not (memq (car binding) assigned))))
+      (define (simple-binding? binding)
+        (and (not (fixed-binding? binding))
+             (not (memq (car binding) assigned))
+             (pure? (cadr binding))
+             (not (any? (lambda (fv) (tree-ref fv bound)) (free-vars (cadr binding))))))
+      (define (complex-binding? binding)
+        (not (or (fixed-binding? binding) (simple-binding? binding))))
+      (let ((simple (filter simple-binding? bindings))
+            (complex (filter complex-binding? bindings)))
+        (bind simple
+              (list (bind (map (lambda (binding) (list (car binding) ''())) complex)
+                          (list (make-fix (filter fixed-binding? bindings)
+                                          (append (map (lambda (binding) (cons 'set! binding)) complex)
+                                                  body))))))))))
+
+;; a desugared let
+(define (bind bindings body)
+  (if (null? bindings)
+      (if (null? (cdr body)) (car body) (cons 'begin body))
+      (cons (cons 'lambda (cons (map car bindings) body))
+            (map cadr bindings))))
+
+;; fix, keeping only the bindings its body reaches
+(define (make-fix bindings body)
+  (let ((live (reachable-bindings bindings body)))
+    (if (null? live)
+        (cons 'begin body)
+        (cons 'fix (cons live body)))))
+
+(define (reachable-bindings bindings body)
+  (let ((graph (reduce (lambda (binding graph) (tree-set (car binding) (free-vars (cadr binding)) graph))
+                       bindings
+                       empty-tree)))
+    (define (search todo live)
+      (cond
+       ((null? todo) live)
+       ((or (tree-ref (car todo) live) (not (tree-ref (car todo) graph))) (search (cdr todo) live))
+       (else (search (append (tree-ref (car todo) graph) (cdr todo)) (tree-set (car todo) #t live)))))
+    (let ((live (search (set-union-all (map free-vars body)) empty-tree)))
+      (filter (lambda (binding) (tree-ref (car binding) live)) bindings))))
 
 (define cond? (tagged-pair? 'cond))
 
+;; a clause with no body gives the value of its test, and a cond with no
+;; clause which applies gives #f
 (define (cond->if x)
   (define (convert-cases cases)
-    (if (not (null? cases))
-        (list 'if (if (eq? (caar cases) 'else) #t (caar cases)) (cadar cases) (convert-cases (cdr cases)))))
+    (cond
+     ((null? cases) #f)
+     ((eq? (caar cases) 'else) (cons 'begin (cdar cases)))
+     ((null? (cdar cases)) (list 'or (caar cases) (convert-cases (cdr cases))))
+     (else (list 'if (caar cases) (cons 'begin (cdar cases)) (convert-cases (cdr cases))))))
   (convert-cases (cdr x)))
 
+(define and? (tagged-pair? 'and))
+(define or? (tagged-pair? 'or))
+
+(define (and->if x)
+  (cond
+   ((null? (cdr x)) #t)
+   ((null? (cddr x)) (cadr x))
+   (else (list 'if (cadr x) (cons 'and (cddr x)) #f))))
+
+;; the value of a true test is kept in a fresh variable
+(define (or->if x)
+  (cond
+   ((null? (cdr x)) #f)
+   ((null? (cddr x)) (cadr x))
+   (else (let ((v (string->symbol (uniq-var "or"))))
+           (list 'let (list (list v (cadr x)))
+                 (list 'if v v (cons 'or (cddr x))))))))
+
+;; an if without an alternative gives #f when its test is false
+(define (desugar-if x)
+  (cons 'if (map desugar (if (null? (cdddr x)) (append (cdr x) (list #f)) (cdr x)))))
+
+;; Definitions
+
+;; The definitions in a body are bound as by letrec*, in order, with each
+;; expression before the last definition bound to a variable of its own
+;; so that it keeps its place. The expressions after it are the body of
+;; the letrec.
+
+(define define? (tagged-pair? 'define))
+
+(define (define-name x)
+  (if (pair? (cadr x)) (caadr x) (cadr x)))
+
+(define (define-value x)
+  (if (pair? (cadr x))
+      (cons 'lambda (cons (cdadr x) (cddr x)))
+      (caddr x)))
+
+;; the forms of a body after its last definition
+(define (after-definitions forms rest)
+  (cond
+   ((null? forms) rest)
+   ((define? (car forms)) (after-definitions (cdr forms) (cdr forms)))
+   (else (after-definitions (cdr forms) rest))))
+
+(define (body->letrec body)
+  (let ((exprs (after-definitions body body)))
+    (define (bindings forms)
+      (cond
+       ((eq? forms exprs) '())
+       ((define? (car forms))
+        (cons (list (define-name (car forms)) (define-value (car forms))) (bindings (cdr forms))))
+       (else (cons (list (string->symbol (uniq-var "_")) (car forms)) (bindings (cdr forms))))))
+    (cons 'letrec (cons (bindings body) (if (null? exprs) (list #f) exprs)))))
+
+(define (desugar-body body)
+  (if (any? define? body)
+      (list (desugar (body->letrec body)))
+      (map desugar body)))
+
+;; A lambda with required formals before its rest formal takes them off
+;; the list of its arguments.
+(define (desugar-lambda x)
+  (let ((formals (cadr x))
+        (body (desugar-body (cddr x))))
+    (if (or (list? formals) (symbol? formals))
+        (cons 'lambda (cons formals body))
+        (let ((args (string->symbol (uniq-var "args"))))
+          (define (spread formals args)
+            (if (pair? formals)
+                (cons (list 'car args) (spread (cdr formals) (list 'cdr args)))
+                (list args)))
+          (list 'lambda args (cons (cons 'lambda (cons (lambda-vars formals) body))
+                                   (spread formals args)))))))
+
+;; Primitives which take any number of arguments
+
+;; Calls of these with other than two arguments are desugared into calls
+;; with two: arithmetic folds from the left, starting from the identity
+;; when there are fewer than two arguments, and a comparison is made of
+;; each adjacent pair. list becomes conses. Used as values, they are
+;; bound to variadic procedures doing the same (see add-bindings).
+
+(define *variadic-primitives*
+  '((+ fold 0) (* fold 1) (- fold 0) (string-append fold "")
+    (= chain) (< chain) (<= chain) (> chain) (>= chain)
+    (list list) (apply spread)))
+
+(define (variadic-call? x)
+  (and (pair? x)
+       (let ((entry (assq (car x) *variadic-primitives*)))
+         (and entry
+              (or (eq? (cadr entry) 'list) (not (= (length (cdr x)) 2)))))))
+
+(define (expand-variadic x)
+  (let ((op (car x))
+        (args (cdr x))
+        (entry (assq (car x) *variadic-primitives*)))
+    (cond
+     ((eq? (cadr entry) 'list)
+      (reduce (lambda (arg acc) (list 'cons arg acc)) (reverse args) ''()))
+     ((eq? (cadr entry) 'spread)
+      (if (or (null? args) (null? (cdr args)))
+          (error "apply needs a procedure and a list:" x)
+          (list op (car args) (spread-args (cdr args)))))
+     ((eq? (cadr entry) 'fold)
+      (cond
+       ((null? args) (caddr entry))
+       ((null? (cdr args)) (list op (caddr entry) (car args)))
+       (else (reduce (lambda (arg acc) (list op acc arg)) (cdr args) (car args)))))
+     ((null? (cdr args)) (list 'begin (car args) #t))
+     (else
+      (let ((vars (map (lambda (arg) (string->symbol (uniq-var "c"))) args)))
+        (define (chain vars)
+          (if (null? (cddr vars))
+              (list op (car vars) (cadr vars))
+              (list 'and (list op (car vars) (cadr vars)) (chain (cdr vars)))))
+        (list 'let (map2 list vars args) (chain vars)))))))
+
+;; the arguments consed onto the last one, which is a list
+(define (spread-args args)
+  (if (null? (cdr args))
+      (car args)
+      (list 'cons (car args) (spread-args (cdr args)))))
+
+(define (fill-template x alist)
+  (cond
+   ((pair? x) (cons (fill-template (car x) alist) (fill-template (cdr x) alist)))
+   ((assq x alist) (cdr (assq x alist)))
+   (else x)))
+
+(define *fold-template*
+  '(lambda xs
+     (letrec ((go (lambda (acc xs) (if (null? xs) acc (go (op acc (car xs)) (cdr xs))))))
+       (cond
+        ((null? xs) identity)
+        ((null? (cdr xs)) (op identity (car xs)))
+        (else (go (car xs) (cdr xs)))))))
+
+(define *chain-template*
+  '(lambda xs
+     (letrec ((go (lambda (x xs) (cond
+                                  ((null? xs) #t)
+                                  ((op x (car xs)) (go (car xs) (cdr xs)))
+                                  (else #f)))))
+       (go (car xs) (cdr xs)))))
+
+(define *spread-template*
+  '(lambda (f . xs)
+     (letrec ((spread (lambda (xs) (if (null? (cdr xs)) (car xs) (cons (car xs) (spread (cdr xs)))))))
+       (op f (spread xs)))))
+
+(define (variadic-procedure entry)
+  (cond
+   ((eq? (cadr entry) 'list) '(lambda xs xs))
+   ((eq? (cadr entry) 'spread) (fill-template *spread-template* (list (cons 'op (car entry)))))
+   ((eq? (cadr entry) 'fold)
+    (fill-template *fold-template* (list (cons 'op (car entry)) (cons 'identity (caddr entry)))))
+   (else (fill-template *chain-template* (list (cons 'op (car entry)))))))
+
 (define (desugar x)
   (cond
    ;; constants
@@ -560,14 +1881,17 @@
    ;; special forms
    ((quote? x) x)
    ((set!? x) (list 'set! (cadr x) (desugar (caddr x))))
-   ((if? x) (cons 'if (map desugar (cdr x))))
+   ((if? x) (desugar-if x))
    ((begin? x) (cons 'begin (map desugar (cdr x))))
-   ((lambda? x) (append (list 'lambda (cadr x)) (map desugar (cddr x))))
+   ((lambda? x) (desugar-lambda x))
 
    ;; sugar
    ((let? x) (desugar (let->lambda x)))
-   ((letrec? x) (desugar (letrec->letset! x)))
+   ((letrec? x) (letrec->fix x))
    ((cond? x) (desugar (cond->if x)))
+   ((and? x) (desugar (and->if x)))
+   ((or? x) (desugar (or->if x)))
+   ((variadic-call? x) (desugar (expand-variadic x)))
 
    ;; primitive calls
    ((primcall? x) (cons (car x) (map desugar (cdr x))))
@@ -579,10 +1903,17 @@
 
 ;; emit a program
 
+;; The C program is written out as it is compiled: each function when
+;; its body is done, then the constants, which its functions refer to
+;; through an incomplete declaration, and main.
+
+(define c-string? (tagged-pair? 'c-string))
+
 (define (emit x)
-  (if (pair? x)
-      (begin (display "(") (for-each emit x) (display ")"))
-      (display x)))
+  (cond
+   ((c-string? x) (write (cadr x)))
+   ((pair? x) (display "(") (for-each emit x) (display ")"))
+   (else (display x))))
 
 (define (emitln x)
   (emit x)
@@ -604,32 +1935,69 @@
   (emit (intercalate "," (map (const "scm") args)))
   (emitln ";"))
 
-(define (emit-function name args expr)
+(define (emit-statement x nslots)
+  (for-each (lambda (part)
+              (if (eq? part 'leave-frame)
+                  (if (< 0 nslots) (emitln "LEAVE_FRAME;"))
+                  (emit part)))
+            x))
+
+(define (emit-function name args nslots loops code)
   (emit "
 scm ")
   (emit name)
   (emit "(") (emit-args args) (emitln ")
 {")
-  (emit "return ") (emit expr) (emitln ";
-}"))
-
-(define (emit-program x)
-  (emitln "#include \"runtime.h\"\n")
-
-  (for-each (lambda (tmp) (emit "scm ") (emit tmp) (emitln ";")) *tmps*)
-  (emitln "")
-
-  (for-each (lambda (l) (emit-function-declaration (car l) (cadr l))) *lambdas*)
-
-  (for-each (lambda (l) (apply emit-function l)) *lambdas*)
-
-  (emit-function 'scheme '() x)
+  (if (< 0 nslots)
+      (begin
+        (emit "scm s[") (emit nslots) (emit "] = {")
+        (if (null? args) (emit 0) (for-each emit (intercalate ", " args)))
+        (emitln "};")
+        (emitln "ENTER_FRAME(s);")))
+  (if loops (emitln "top:"))
+  (emit-statement code nslots)
+  (emitln "}"))
+
+(define (emit-constants)
+  (let ((n (length *constants*)))
+    (emit "\nscm constants[") (emit n) (emitln "];")
+    (emitln "
+void init_constants()
+{")
+    (emit "gc_register_roots(constants,") (emit n) (emitln ");")
+    (enumerate (lambda (i init)
+                 (emit (constant-ref i)) (emit " = ") (emit init) (emitln ";"))
+               (reverse *constants*))
+    (emitln "}\n")))
 
+(define (emit-census-lambdas)
   (emitln "
-int main()
+#ifdef SCHEME_CENSUS
+census_lambda census_lambdas[] = {")
+  (for-each (lambda (entry)
+              (emit "{&") (emit (car entry)) (emit ", ") (emit (c-string (car entry)))
+              (emit ", ") (emit (c-string (cdr entry))) (emitln "},"))
+            (reverse *census-lambdas*))
+  (emitln "{NULL, NULL, NULL}
+};
+#endif"))
+
+(define (emit-main main)
+  (emitln "
+int main(int argc, char **argv)
 {
-print_scm_val(scheme());
-return 0;
+#ifdef SCHEME_CENSUS
+census_init(census_lambdas);
+#endif")
+  (if main
+      (emitln "init_command_line(argc, argv);"))
+  (if (not (null? *constants*))
+      (emitln "init_constants();"))
+  (if main
+      (emitln "run_tail_calls(scheme());
+flush_output();")
+      (emitln "print_scm_val(run_tail_calls(scheme()));"))
+  (emitln "return 0;
 }"))
 
 (define *bound-defs* '())
@@ -637,43 +2005,87 @@ return 0;
 (define (arg-list n)
   (dotimes (lambda (i) (string->symbol (string-append "a" (number->string i)))) n))
 
+;; A primitive used other than by calling it, such as one passed to map,
+;; is bound to a procedure which calls it.
 (define (bind-primitive primitive)
   (let ((n (cdr (assq-ref primitive *primitives*))))
-    (if (number? n)
-        (set! *bound-defs* (cons (cons primitive (arg-list n)) *bound-defs*)))))
+    (if (and (number? n) (not (assq primitive *variadic-primitives*)))
+        (let ((args (arg-list n)))
+          (set! *bound-defs* (cons (list primitive 'lambda args (cons primitive args)) *bound-defs*))))))
 
-;;; TODO: only bind the needed primitives
+(define (bind-variadic-primitive entry)
+  (set! *bound-defs* (cons (cons (car entry) (desugar (variadic-procedure entry))) *bound-defs*)))
 
 (for-each bind-primitive (map car *primitives*))
+(for-each bind-variadic-primitive *variadic-primitives*)
 
+;; The procedures are bound around the program. x has been desugared.
 (define (add-bindings x)
-  (list 'let (map (lambda (def) (list (car def) (list 'lambda (cdr def) def))) *bound-defs*)
-        x))
-
-(define (compile x)
-  (emit-program (compile-expr (closure-convert (convert-mutable-vars (desugar (add-bindings x)))) (empty-env))))
-
-(define *defines* '())
-
-(define (add-define x)
-  (set! *defines* (cons (list (caadr x) (list 'lambda (cdadr x) (caddr x))) *defines*)))
-
-(define (with-defines x)
-  (list 'letrec *defines* x))
-
-(define define? (tagged-pair? 'define))
-
-(define (read-prog o)
-  (let ((x (read o)))
-    (if (not (eq? x (eof-object)))
-        (if (define? x)
-            (begin (add-define x) (read-prog o))
-            ;; kind of stupid
-            (compile (if (< 0 (length *defines*)) (with-defines x) x))))))
+  (let ((fvs (free-vars x)))
+    (let ((defs (reduce (lambda (def acc) (if (memq (car def) fvs) (cons def acc) acc))
+                        *bound-defs*
+                        '())))
+      (if (null? defs)
+          x
+          (cons (list 'lambda (map car defs) x)
+                (map cdr defs))))))
+
+(define (compile x main)
+  (set! *slots* 0)
+  (set! *function* (list "scheme" 0 #f))
+  (set! *loops* #f)
+  (set! *constants* '())
+  (set! *symbol-constants* '())
+  (set! *lambda-sources* '())
+  (set! *source-name* #f)
+  (set! *census-lambdas* '())
+  (emitln "#include \"runtime.h\"\n")
+  (emitln "extern scm constants[];")
+  (let ((code (compile-tail (closure-convert (convert-mutable-vars (optimize-program (add-bindings (desugar x)))) empty-tree)
+                            (empty-env))))
+    (emit-function 'scheme '() *slots* #f code))
+  (if (not (null? *constants*))
+      (emit-constants))
+  (emit-census-lambdas)
+  (emit-main main))
+
+;; A program is a sequence of definitions and expressions, which may
+;; load files of more, compiled as a body (see body->letrec). If it
+;; defines main, main is called with the command line arguments after
+;; the program's name; otherwise the value of its last expression is
+;; printed.
+
+(define load? (tagged-pair? 'load))
+
+(define (read-forms port)
+  (let ((x (read port)))
+    (cond
+     ((eq? x (eof-object)) '())
+     ((load? x) (append (read-file (cadr x)) (read-forms port)))
+     (else (cons x (read-forms port))))))
+
+(define (read-file path)
+  (let ((port (open-input-file path)))
+    (let ((forms (read-forms port)))
+      (close-port port)
+      forms)))
+
+(define (main-definition? x)
+  (and (define? x) (eq? (define-name x) 'main)))
+
+(define (compile-program forms)
+  (let ((main (any? main-definition? forms)))
+    (let ((body (if main (append forms (list '(main (cdr (command-line))))) forms)))
+      (compile (cond
+                ((any? define? body) (body->letrec body))
+                ((null? (cdr body)) (car body))
+                (else (cons 'begin body)))
+               main))))
 
 (define (main args)
-  (if (not (= (length args) 1))
-      (error "wrong # of command line arguments"))
-  (let ((o (open-input-file (car args))))
-    (read-prog o)
-    (close-port o)))
+  (cond
+   ((null? args) (error "wrong # of command line arguments"))
+   ((null? (cdr args)) (compile-program (read-file (car args))))
+   (else
+    (set-optimization-level! (string->symbol (car args)))
+    (main (cdr args)))))
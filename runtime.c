@@ -1,119 +1,1078 @@
 #include "runtime.h"
+#include <errno.h>
+#include <limits.h>
+
+/* Garbage collection */
+
+#define DEFAULT_NURSERY_SIZE (1 << 20)
+#define MIN_NURSERY_SIZE (1 << 16)
+
+gcframe *gcstack = NULL;
+gcframe *globalroots = NULL;
+
+char *nurserystart = NULL;
+char *nurseryend = NULL;
+char *nurseryfree = NULL;
+
+char *oldstart = NULL;
+char *oldend = NULL;
+char *oldfree = NULL;
+
+scm **remembered = NULL;
+size_t nremembered = 0;
+size_t remembercap = 0;
+
+size_t nurserysize;
+char *sparenursery = NULL;
+int gcstress = 0;
+long minorcollections = 0;
+long majorcollections = 0;
+size_t peakoldbytes = 0;
+long allocations = 0;
+size_t allocatedbytes = 0;
+
+#define WORDS(n) (((n) + sizeof(scm) - 1) / sizeof(scm))
+#define STRING_WORDS(len) (1 + WORDS((len) + 1))
+
+/* blocks are aligned to 16 bytes, leaving the low four bits for tags */
+#define ALIGN_WORDS(n) (((n) + 1) & ~(size_t)1)
+
+void remember(scm *slot)
+{
+  if (nremembered == remembercap) {
+    remembercap = remembercap ? 2 * remembercap : 1024;
+    remembered = realloc(remembered, remembercap * sizeof(scm *));
+  }
+  remembered[nremembered++] = slot;
+}
+
+size_t block_words(block *b)
+{
+  size_t len = b->header >> headershift;
+  switch (b->header & headermask) {
+  case vectortag:
+    return ALIGN_WORDS(len + 1);
+  case symboltag:
+    return ALIGN_WORDS(1 + STRING_WORDS(len));
+  case stringtag:
+    return ALIGN_WORDS(STRING_WORDS(len));
+  case pairtag:
+    return ALIGN_WORDS(3);
+  case closuretag:
+  case variadictag:
+    return ALIGN_WORDS(len + 2);
+  case porttag:
+    return ALIGN_WORDS(2);
+  default:
+    fprintf(stderr, "gc: bad block header 0x%zx\n", b->header);
+    abort();
+  }
+}
+
+/* the slots of a block which may hold scm values */
+scm *block_fields(block *b, size_t *n)
+{
+  size_t len = b->header >> headershift;
+  switch (b->header & headermask) {
+  case vectortag:
+    *n = len;
+    return b->data;
+  case pairtag:
+    *n = 2;
+    return b->data;
+  case closuretag:
+  case variadictag:
+    *n = len;
+    return b->data + 1;
+  default:
+    *n = 0;
+    return NULL;
+  }
+}
+
+int majorgc = 0;
+
+/* a minor collection moves only the nursery, a major one moves the old
+   generation too */
+int in_from_space(scm x)
+{
+  return IS_YOUNG(x) ||
+    (majorgc && IS_HEAP_PTR(x) && (char *)x >= oldstart && (char *)x < oldend);
+}
+
+/* Copy the object in slot to *to if it is being collected, leaving a
+   forwarding pointer behind. */
+void evacuate(scm *slot, char **to)
+{
+  scm x = *slot;
+  if (!in_from_space(x))
+    return;
+  block *b = (block *)x;
+  if ((b->header & headermask) == forwardtag) {
+    *slot = b->data[0];
+    return;
+  }
+  size_t bytes = block_words(b) * sizeof(scm);
+  block *copy = (block *)*to;
+  memcpy(copy, b, bytes);
+  *to += bytes;
+  b->header = forwardtag;
+  b->data[0] = (scm)copy;
+  *slot = (scm)copy;
+}
+
+void evacuate_frames(gcframe *frames, char **to)
+{
+  for (gcframe *fr = frames; fr != NULL; fr = fr->prev)
+    for (size_t i = 0; i < fr->n; ++i)
+      evacuate(&fr->slots[i], to);
+}
+
+void evacuate_roots(char **to)
+{
+  evacuate_frames(gcstack, to);
+  evacuate_frames(globalroots, to);
+}
+
+/* Register an array of values that live for the whole program, such as
+   the compiled program's constants. */
+void gc_register_roots(scm *roots, size_t n)
+{
+  gcframe *fr = malloc(sizeof(gcframe));
+  fr->prev = globalroots;
+  fr->n = n;
+  fr->slots = roots;
+  globalroots = fr;
+}
+
+void scan(char *scan, char **to)
+{
+  while (scan < *to) {
+    block *b = (block *)scan;
+    size_t n;
+    scm *fields = block_fields(b, &n);
+    for (size_t i = 0; i < n; ++i)
+      evacuate(&fields[i], to);
+    scan += block_words(b) * sizeof(scm);
+  }
+}
+
+/* Copy everything reachable into a fresh old generation with room for
+   at least need more bytes. */
+void major_gc(size_t need)
+{
+  size_t used = (oldfree - oldstart) + (nurseryfree - nurserystart);
+  size_t size = oldend - oldstart;
+  while (size < 2 * used + need)
+    size *= 2;
+
+  char *newstart = malloc(size);
+  if (newstart == NULL) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+  char *to = newstart;
+
+  majorgc = 1;
+  evacuate_roots(&to);
+  scan(newstart, &to);
+  majorgc = 0;
+
+  free(oldstart);
+  oldstart = newstart;
+  oldend = newstart + size;
+  oldfree = to;
+  nurseryfree = nurserystart;
+  nremembered = 0;
+
+  if ((size_t)(oldfree - oldstart) > peakoldbytes)
+    peakoldbytes = oldfree - oldstart;
+  ++majorcollections;
+}
+
+/* Promote the survivors of the nursery into the old generation. */
+void minor_gc()
+{
+  if ((size_t)(oldend - oldfree) < (size_t)(nurseryfree - nurserystart)) {
+    major_gc(nurserysize);
+    return;
+  }
+
+  char *to = oldfree;
+  evacuate_roots(&to);
+  for (size_t i = 0; i < nremembered; ++i)
+    evacuate(remembered[i], &to);
+  scan(oldfree, &to);
+
+  oldfree = to;
+  nurseryfree = nurserystart;
+  nremembered = 0;
+
+  /* in stress mode alternate between two poisoned nurseries so stale
+     pointers into the last one are caught */
+  if (gcstress) {
+    memset(nurserystart, 0xdb, nurserysize);
+    char *spare = sparenursery;
+    sparenursery = nurserystart;
+    nurserystart = nurseryfree = spare;
+    nurseryend = nurserystart + nurserysize;
+  }
+
+  if ((size_t)(oldfree - oldstart) > peakoldbytes)
+    peakoldbytes = oldfree - oldstart;
+  ++minorcollections;
+}
+
+void gc_stats()
+{
+  fprintf(stderr, "gc: %ld minor, %ld major collections, %ld objects (%zu bytes) allocated, peak old generation %zu bytes\n",
+          minorcollections, majorcollections, allocations, allocatedbytes, peakoldbytes);
+}
+
+void gc_init()
+{
+  char *size = getenv("SCHEME_NURSERY_SIZE");
+  nurserysize = size ? strtoul(size, NULL, 0) : DEFAULT_NURSERY_SIZE;
+  if (nurserysize < MIN_NURSERY_SIZE)
+    nurserysize = MIN_NURSERY_SIZE;
+
+  nurserystart = nurseryfree = malloc(nurserysize);
+  nurseryend = nurserystart + nurserysize;
+  oldstart = oldfree = malloc(4 * nurserysize);
+  oldend = oldstart + 4 * nurserysize;
+
+  if (getenv("SCHEME_GC_STATS") != NULL)
+    atexit(gc_stats);
+  if (getenv("SCHEME_GC_STRESS") != NULL) {
+    gcstress = 1;
+    sparenursery = malloc(nurserysize);
+  }
+}
+
+/* Objects larger than half the nursery go straight to the old
+   generation. */
+block *gc_alloc(size_t words)
+{
+  size_t bytes = ALIGN_WORDS(words) * sizeof(scm);
+
+  if (nurserystart == NULL)
+    gc_init();
+  ++allocations;
+  allocatedbytes += bytes;
+
+  if (bytes > nurserysize / 2) {
+    if ((size_t)(oldend - oldfree) < bytes)
+      major_gc(bytes);
+    block *b = (block *)oldfree;
+    oldfree += bytes;
+    return b;
+  }
+
+  if (gcstress || nurseryfree + bytes > nurseryend)
+    minor_gc();
+  block *b = (block *)nurseryfree;
+  nurseryfree += bytes;
+  return b;
+}
+
+/* Allocation census (see runtime.h). The counts for a closure are found
+   by its function in an open-addressed table of the program's lambdas,
+   with a last entry for functions missing from the table. */
+
+#ifdef SCHEME_CENSUS
+
+typedef struct {
+  long objects;
+  size_t bytes;
+} census_count;
+
+char *census_tag_names[] = {
+  "vector", "symbol", "string", "pair", "closure", "variadic", "port"
+};
+
+#define CENSUS_TAGS (sizeof(census_tag_names) / sizeof(census_tag_names[0]))
+
+int census_on = 0;
+census_count census_tags[CENSUS_TAGS];
+census_lambda *census_table = NULL;
+size_t ncensuslambdas = 0;
+census_count *census_closures = NULL;
+size_t *census_slots = NULL;
+size_t census_slots_size = 0;
+
+/* the slot holding one more than the index of fn's lambda, or 0 */
+size_t census_slot(void *fn)
+{
+  size_t mask = census_slots_size - 1;
+  size_t i = ((size_t)fn * 11400714819323198485UL >> 32) & mask;
+  while (census_slots[i] != 0 && census_table[census_slots[i] - 1].fn != fn)
+    i = (i + 1) & mask;
+  return i;
+}
+
+void census_count_block(block *b)
+{
+  if (!census_on)
+    return;
+  size_t tag = b->header & headermask;
+  size_t bytes = block_words(b) * sizeof(scm);
+  ++census_tags[tag].objects;
+  census_tags[tag].bytes += bytes;
+  if (tag == closuretag || tag == variadictag) {
+    size_t i = census_slots[census_slot((void *)b->data[0])];
+    census_count *c = &census_closures[i == 0 ? ncensuslambdas : i - 1];
+    ++c->objects;
+    c->bytes += bytes;
+  }
+}
+
+int census_by_bytes(const void *x, const void *y)
+{
+  size_t a = census_closures[*(size_t *)x].bytes;
+  size_t b = census_closures[*(size_t *)y].bytes;
+  return a < b ? 1 : a > b ? -1 : 0;
+}
+
+void census_report()
+{
+  long objects = 0;
+  size_t bytes = 0;
+  for (size_t tag = 0; tag < CENSUS_TAGS; ++tag) {
+    objects += census_tags[tag].objects;
+    bytes += census_tags[tag].bytes;
+  }
+  fprintf(stderr, "census: %ld objects (%zu bytes) allocated\n", objects, bytes);
+  for (size_t tag = 0; tag < CENSUS_TAGS; ++tag)
+    if (census_tags[tag].objects != 0)
+      fprintf(stderr, "  %-10s %12ld %14zu\n",
+              census_tag_names[tag], census_tags[tag].objects, census_tags[tag].bytes);
+
+  size_t *order = malloc((ncensuslambdas + 1) * sizeof(size_t));
+  size_t n = 0;
+  for (size_t i = 0; i <= ncensuslambdas; ++i)
+    if (census_closures[i].objects != 0)
+      order[n++] = i;
+  qsort(order, n, sizeof(size_t), census_by_bytes);
+  if (n != 0)
+    fprintf(stderr, "census: closures by lambda\n");
+  for (size_t i = 0; i < n; ++i) {
+    census_count *c = &census_closures[order[i]];
+    int known = order[i] < ncensuslambdas;
+    fprintf(stderr, "  %-10s %12ld %14zu  %s\n",
+            known ? census_table[order[i]].name : "?", c->objects, c->bytes,
+            known ? census_table[order[i]].source : "(not in the program's table)");
+  }
+  free(order);
+}
+
+void census_init(census_lambda *lambdas)
+{
+  if (getenv("SCHEME_CENSUS") == NULL)
+    return;
+  census_on = 1;
+  census_table = lambdas;
+  while (lambdas[ncensuslambdas].fn != NULL)
+    ++ncensuslambdas;
+  census_closures = calloc(ncensuslambdas + 1, sizeof(census_count));
+  census_slots_size = 16;
+  while (census_slots_size < 2 * ncensuslambdas)
+    census_slots_size *= 2;
+  census_slots = calloc(census_slots_size, sizeof(size_t));
+  for (size_t i = 0; i < ncensuslambdas; ++i)
+    census_slots[census_slot(lambdas[i].fn)] = i + 1;
+  atexit(census_report);
+}
+
+#define CENSUS(b) census_count_block(b)
+#else
+#define CENSUS(b)
+#endif
+
+/* Allocation. Arguments which are heap pointers are kept in a frame
+   while allocating, since a collection may move them. */
 
 scm allocvector(size_t len)
 {
-  block *vector = malloc(sizeof(scm) * (len + 1));
+  block *vector = gc_alloc(len + 1);
   vector->header = TAG(len, headershift, vectortag);
+  CENSUS(vector);
+  memset(vector->data, 0, len * sizeof(scm));
   return (scm)vector;
 }
 
-typedef struct _Node {
-  block *scm_val;
-  struct _Node *next;
-} Node;
+/* Symbols are interned forever, so they live outside the heap in an
+   open-addressed hash table keyed on their names. A symbol block holds
+   the hash of its name followed by the name itself. */
+
+#define INITIAL_SYMBOL_TABLE_SIZE 256
+
+block **symboltable = NULL;
+size_t symboltablesize = 0;
+size_t nsymbols = 0;
 
-Node *INTERNED_SYMBOLS_LIST = NULL;
+/* FNV-1a */
+size_t hash_name(char *name, size_t len)
+{
+  size_t hash = 14695981039346656037UL;
+  for (size_t i = 0; i < len; ++i) {
+    hash ^= (unsigned char)name[i];
+    hash *= 1099511628211UL;
+  }
+  return hash;
+}
+
+block **symbol_slot(char *name, size_t len, size_t hash)
+{
+  size_t mask = symboltablesize - 1;
+  for (size_t i = hash & mask;; i = (i + 1) & mask) {
+    block *s = symboltable[i];
+    if (s == NULL ||
+        ((size_t)s->data[0] == hash && s->header >> headershift == len &&
+         memcmp(SYMBOL_NAME(s), name, len) == 0))
+      return &symboltable[i];
+  }
+}
 
-Node *allocnode(block *scm_val, Node *next)
+void grow_symbol_table()
 {
-  Node *node = malloc(sizeof(Node));
-  node->scm_val = scm_val;
-  node->next = next;
-  return node;
+  block **old = symboltable;
+  size_t oldsize = symboltablesize;
+
+  symboltablesize = oldsize ? 2 * oldsize : INITIAL_SYMBOL_TABLE_SIZE;
+  symboltable = calloc(symboltablesize, sizeof(block *));
+  for (size_t i = 0; i < oldsize; ++i)
+    if (old[i] != NULL) {
+      block *s = old[i];
+      *symbol_slot(SYMBOL_NAME(s), s->header >> headershift, (size_t)s->data[0]) = s;
+    }
+  free(old);
 }
 
 scm allocsymbol(char *name, size_t len)
 {
-  for (Node *n = INTERNED_SYMBOLS_LIST; n != NULL; n = n->next)
-    if (strncmp((char *)n->scm_val->data, name, len) == 0)
-      return (scm)n->scm_val;
+  if (4 * (nsymbols + 1) > 3 * symboltablesize)
+    grow_symbol_table();
 
-  block *symbol = malloc(sizeof(scm) * (len + 2));
-  symbol->header = TAG(len, headershift, symboltag);
-  strncpy((char *)symbol->data, name, len + 1);
+  size_t hash = hash_name(name, len);
+  block **slot = symbol_slot(name, len, hash);
+  if (*slot != NULL)
+    return (scm)*slot;
 
-  INTERNED_SYMBOLS_LIST = allocnode(symbol, INTERNED_SYMBOLS_LIST);
+  block *symbol = malloc(sizeof(scm) * (1 + STRING_WORDS(len)));
+  symbol->header = TAG(len, headershift, symboltag);
+  symbol->data[0] = hash;
+  memcpy(SYMBOL_NAME(symbol), name, len);
+  SYMBOL_NAME(symbol)[len] = '\0';
+  *slot = symbol;
+  ++nsymbols;
+  CENSUS(symbol);
 
   return (scm)symbol;
 }
 
 scm allocstring(char *str, size_t len)
 {
-  block *string = malloc(sizeof(scm) * (len + 2));
+  block *string = gc_alloc(STRING_WORDS(len));
   string->header = TAG(len, headershift, stringtag);
-  strncpy((char *)string->data, str, len + 1);
+  CENSUS(string);
+  memcpy(string->data, str, len);
+  ((char *)string->data)[len] = '\0';
   return (scm)string;
 }
 
-scm allocclosure(void *fp, size_t nfvs)
+/* Closures are always allocated in the nursery so that their free
+   variables can be filled in without a write barrier. */
+scm alloc_procedure(void *fp, size_t nfvs, scm tag)
 {
-  block *closure = malloc(sizeof(scm) * (nfvs + 2));
-  closure->header = closuretag;
+  if (nurserystart == NULL)
+    gc_init();
+  if ((nfvs + 2) * sizeof(scm) > nurserysize / 2) {
+    fprintf(stderr, "closure with %zu free variables does not fit in the nursery\n", nfvs);
+    exit(1);
+  }
+  block *closure = gc_alloc(nfvs + 2);
+  closure->header = TAG(nfvs, headershift, tag);
   closure->data[0] = (scm)fp;
+  CENSUS(closure);
+  memset(closure->data + 1, 0, nfvs * sizeof(scm));
   return (scm)closure;
 }
 
+scm allocclosure(void *fp, size_t nfvs)
+{
+  return alloc_procedure(fp, nfvs, closuretag);
+}
+
+scm allocvariadic(void *fp, size_t nfvs)
+{
+  return alloc_procedure(fp, nfvs, variadictag);
+}
+
 scm cons(scm car, scm cdr)
 {
-  block *pair = malloc(sizeof(scm) * 3);
+  scm s[2] = {car, cdr};
+  ENTER_FRAME(s);
+  block *pair = gc_alloc(3);
+  LEAVE_FRAME;
   pair->header = pairtag;
-  pair->data[0] = car;
-  pair->data[1] = cdr;
+  CENSUS(pair);
+  pair->data[0] = s[0];
+  pair->data[1] = s[1];
   return (scm)pair;
 }
 
-void write(scm scm_val);
+/* Tail calls */
+
+/* a pending tail call */
+void *tailfn = NULL;
+scm tailargs[MAX_TAIL_ARGS];
+size_t ntailargs = 0;
+
+scm call_pending(void)
+{
+  scm *a = tailargs;
+  void *fp = tailfn;
+  switch (ntailargs) {
+  case 0: return ((scm(*)(void))fp)();
+  case 1: return ((scm(*)(scm))fp)(a[0]);
+  case 2: return ((scm(*)(scm,scm))fp)(a[0],a[1]);
+  case 3: return ((scm(*)(scm,scm,scm))fp)(a[0],a[1],a[2]);
+  case 4: return ((scm(*)(scm,scm,scm,scm))fp)(a[0],a[1],a[2],a[3]);
+  case 5: return ((scm(*)(scm,scm,scm,scm,scm))fp)(a[0],a[1],a[2],a[3],a[4]);
+  case 6: return ((scm(*)(scm,scm,scm,scm,scm,scm))fp)(a[0],a[1],a[2],a[3],a[4],a[5]);
+  case 7: return ((scm(*)(scm,scm,scm,scm,scm,scm,scm))fp)(a[0],a[1],a[2],a[3],a[4],a[5],a[6]);
+  case 8: return ((scm(*)(scm,scm,scm,scm,scm,scm,scm,scm))fp)(a[0],a[1],a[2],a[3],a[4],a[5],a[6],a[7]);
+  default:
+    fprintf(stderr, "tail call with %zu arguments\n", ntailargs);
+    abort();
+  }
+}
+
+/* A call through a variadic closure gathers its arguments into a list.
+   They are in the caller's array, which is kept in a frame while the
+   list is consed. */
+scm call_variadic(size_t n, scm *args)
+{
+  gcframe frame = { gcstack, n, args };
+  gcstack = &frame;
+  scm list = null;
+  for (size_t i = n - 1; i > 0; --i)
+    list = cons(args[i], list);
+  LEAVE_FRAME;
+  return ((scm(*)(scm,scm))((block *)args[0])->data[0])(args[0], list);
+}
+
+/* apply spreads the list of arguments into a pending call, unless the
+   procedure takes them as a list. Nothing allocates between filling in
+   the call and making it. */
+scm apply(scm proc, scm args)
+{
+  if (IS_VARIADIC(proc))
+    return run_tail_calls(((scm(*)(scm,scm))((block *)proc)->data[0])(proc, args));
+  size_t n = 1 + list_length(args);
+  if (n > MAX_TAIL_ARGS) {
+    flush_output();
+    fprintf(stderr, "apply: at most %d arguments can be passed to a procedure of fixed arity, not %zu\n",
+            MAX_TAIL_ARGS - 1, n - 1);
+    exit(1);
+  }
+  tailfn = (void *)((block *)proc)->data[0];
+  tailargs[0] = proc;
+  for (size_t i = 1; i < n; ++i, args = CDR(args))
+    tailargs[i] = CAR(args);
+  ntailargs = n;
+  return run_tail_calls(TAILCALL);
+}
+
+/* Lists, strings and symbols */
+
+long list_length(scm list)
+{
+  long n = 0;
+  for (; IS_PAIR(list); list = CDR(list))
+    ++n;
+  return n;
+}
+
+#define STRING_CHARS(x) ((char *)((block *)(x))->data)
+#define STRING_LENGTH(x) (((block *)(x))->header >> headershift)
+
+scm string_append(scm x, scm y)
+{
+  scm s[2] = {x, y};
+  ENTER_FRAME(s);
+  size_t xlen = STRING_LENGTH(x);
+  size_t ylen = STRING_LENGTH(y);
+  block *string = gc_alloc(STRING_WORDS(xlen + ylen));
+  LEAVE_FRAME;
+  string->header = TAG((xlen + ylen), headershift, stringtag);
+  CENSUS(string);
+  memcpy(string->data, STRING_CHARS(s[0]), xlen);
+  memcpy((char *)string->data + xlen, STRING_CHARS(s[1]), ylen + 1);
+  return (scm)string;
+}
+
+scm number_to_string(scm n)
+{
+  char buffer[24];
+  int len = snprintf(buffer, sizeof(buffer), "%ld", (long)n >> fxshift);
+  return allocstring(buffer, len);
+}
+
+/* #f unless the whole string is a decimal integer which fits in a
+   fixnum. strtol would also skip leading whitespace and a plus sign. */
+scm string_to_number(scm string)
+{
+  char *str = STRING_CHARS(string);
+  char *digits = str + (*str == '-');
+  if (*digits < '0' || *digits > '9')
+    return f;
+  char *end;
+  errno = 0;
+  long n = strtol(str, &end, 10);
+  if (*end != '\0' || errno == ERANGE || n < LONG_MIN / 2 || n > LONG_MAX / 2)
+    return f;
+  return TAG((scm)n, fxshift, fxtag);
+}
+
+scm symbol_to_string(scm symbol)
+{
+  return allocstring(SYMBOL_NAME(symbol), ((block *)symbol)->header >> headershift);
+}
+
+scm string_to_symbol(scm string)
+{
+  return allocsymbol(STRING_CHARS(string), STRING_LENGTH(string));
+}
+
+/* The command line arguments, as a list of strings starting with the
+   program's name */
+scm command_line = null;
+
+void init_command_line(int argc, char **argv)
+{
+  gc_register_roots(&command_line, 1);
+  for (int i = argc - 1; i >= 0; --i) {
+    scm arg = allocstring(argv[i], strlen(argv[i]));
+    command_line = cons(arg, command_line);
+  }
+}
+
+/* Input
+
+   An input port holds the whole of its file, which read_datum parses
+   with the same syntax as the interpreter's reader. */
+
+typedef struct {
+  char *buf;
+  char *pos;
+  char *end;
+} port;
+
+#define PORT(x) ((port *)((block *)(x))->data[0])
+
+scm open_input_file(scm path)
+{
+  FILE *file = fopen(STRING_CHARS(path), "r");
+  if (file == NULL) {
+    flush_output();
+    fprintf(stderr, "could not open %s\n", STRING_CHARS(path));
+    exit(1);
+  }
+  size_t cap = 65536;
+  size_t len = 0;
+  char *buf = malloc(cap);
+  size_t n;
+  while ((n = fread(buf + len, 1, cap - len, file)) > 0)
+    if ((len += n) == cap)
+      buf = realloc(buf, cap *= 2);
+  fclose(file);
+
+  port *p = malloc(sizeof(port));
+  p->buf = p->pos = buf;
+  p->end = buf + len;
+  block *b = gc_alloc(2);
+  b->header = TAG(0, headershift, porttag);
+  CENSUS(b);
+  b->data[0] = (scm)p;
+  return (scm)b;
+}
+
+scm close_port(scm x)
+{
+  port *p = PORT(x);
+  if (p != NULL) {
+    free(p->buf);
+    free(p);
+    ((block *)x)->data[0] = 0;
+  }
+  return null;
+}
+
+void read_error(char *message)
+{
+  flush_output();
+  fprintf(stderr, "%s\n", message);
+  exit(1);
+}
+
+int is_whitespace(int c)
+{
+  return c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == '\f' || c == '\v';
+}
+
+int is_delimiter(port *p, char *c)
+{
+  return c == p->end || is_whitespace(*c) || *c == '(' || *c == ')';
+}
+
+void skip_whitespace(port *p)
+{
+  while (p->pos < p->end) {
+    if (is_whitespace(*p->pos))
+      ++p->pos;
+    else if (*p->pos == ';') {
+      char *nl = memchr(p->pos, '\n', p->end - p->pos);
+      p->pos = nl == NULL ? p->end : nl + 1;
+    }
+    else
+      break;
+  }
+}
+
+scm read_port(port *p);
+
+/* The list is built front to back, keeping its head and last pair in a
+   frame while the rest is read. */
+scm read_list(port *p)
+{
+  scm s[2] = {null, null};
+  ENTER_FRAME(s);
+  while (1) {
+    skip_whitespace(p);
+    if (p->pos == p->end)
+      read_error("unexpected end of file in list");
+    if (*p->pos == ')') {
+      ++p->pos;
+      break;
+    }
+    if (s[0] != null && *p->pos == '.' && is_delimiter(p, p->pos + 1)) {
+      ++p->pos;
+      scm x = read_port(p);
+      vector_set(s[1], 1, x);
+      skip_whitespace(p);
+      if (p->pos == p->end || *p->pos++ != ')')
+        read_error("invalid use of .");
+      break;
+    }
+    scm x = read_port(p);
+    x = cons(x, null);
+    if (s[0] == null)
+      s[0] = x;
+    else
+      vector_set(s[1], 1, x);
+    s[1] = x;
+  }
+  LEAVE_FRAME;
+  return s[0];
+}
+
+scm read_string(port *p)
+{
+  char *start = p->pos;
+  char *q = start;
+  while (q < p->end && *q != '"' && *q != '\\')
+    ++q;
+  if (q < p->end && *q == '"') {
+    p->pos = q + 1;
+    return allocstring(start, q - start);
+  }
+
+  /* escapes only make strings shorter, so the string is unescaped in
+     place in the port's buffer */
+  char *out = start;
+  while (1) {
+    if (p->pos == p->end)
+      read_error("unexpected end of file in string");
+    char c = *p->pos++;
+    if (c == '"')
+      break;
+    if (c == '\\') {
+      if (p->pos == p->end)
+        read_error("unexpected end of file in string");
+      switch (c = *p->pos++) {
+      case 'n':
+        c = '\n';
+        break;
+      case '"':
+      case '\\':
+        break;
+      default:
+        read_error("unrecognized escape sequence");
+      }
+    }
+    *out++ = c;
+  }
+  return allocstring(start, out - start);
+}
+
+int starts_with(port *p, char *s)
+{
+  size_t n = strlen(s);
+  return (size_t)(p->end - p->pos) >= n && memcmp(p->pos, s, n) == 0 &&
+    is_delimiter(p, p->pos + n);
+}
+
+scm read_port(port *p)
+{
+  skip_whitespace(p);
+  if (p->pos == p->end)
+    return eof;
+  char c = *p->pos;
+  char *digits = p->pos + (c == '-');
+  if (digits < p->end && *digits >= '0' && *digits <= '9') {
+    long n = 0;
+    for (p->pos = digits; p->pos < p->end && *p->pos >= '0' && *p->pos <= '9'; ++p->pos)
+      n = 10 * n + (*p->pos - '0');
+    return TAG((scm)(c == '-' ? -n : n), fxshift, fxtag);
+  }
+  ++p->pos;
+  switch (c) {
+  case '(':
+    return read_list(p);
+  case ')':
+    read_error("unbalanced parenthesis");
+  case '\'': {
+    scm quoted = read_port(p);
+    quoted = cons(quoted, null);
+    return cons(allocsymbol("quote", 5), quoted);
+  }
+  case '"':
+    return read_string(p);
+  case '#':
+    if (p->pos == p->end)
+      read_error("# not followed by t, f, or \\");
+    switch (*p->pos++) {
+    case 't':
+      return t;
+    case 'f':
+      return f;
+    case '\\':
+      if (starts_with(p, "space")) {
+        p->pos += 5;
+        return TAG((scm)' ', cshift, ctag);
+      }
+      if (starts_with(p, "newline")) {
+        p->pos += 7;
+        return TAG((scm)'\n', cshift, ctag);
+      }
+      if (p->pos == p->end)
+        read_error("unexpected end of file in character");
+      return TAG((scm)(unsigned char)*p->pos++, cshift, ctag);
+    default:
+      read_error("# not followed by t, f, or \\");
+    }
+  }
+  char *start = --p->pos;
+  while (!is_delimiter(p, p->pos))
+    ++p->pos;
+  return allocsymbol(start, p->pos - start);
+}
+
+scm read_datum(scm x)
+{
+  return read_port(PORT(x));
+}
+
+/* Output
+
+   write formats into a large buffer which goes to stdout in one call
+   when it fills and when flush_output is called */
+
+#define OUTPUT_BUFFER_LEN 65536
+
+char outbuf[OUTPUT_BUFFER_LEN];
+size_t outlen = 0;
+
+/* stdout, unless an error is being reported */
+FILE *outfile = NULL;
+
+void flush_output()
+{
+  FILE *out = outfile ? outfile : stdout;
+  fwrite(outbuf, 1, outlen, out);
+  outlen = 0;
+  fflush(out);
+}
+
+void out_bytes(char *s, size_t n)
+{
+  if (outlen + n > OUTPUT_BUFFER_LEN) {
+    flush_output();
+    if (n > OUTPUT_BUFFER_LEN) {
+      fwrite(s, 1, n, outfile ? outfile : stdout);
+      return;
+    }
+  }
+  memcpy(outbuf + outlen, s, n);
+  outlen += n;
+}
+
+void out_string(char *s)
+{
+  out_bytes(s, strlen(s));
+}
+
+void out_char(char c)
+{
+  if (outlen == OUTPUT_BUFFER_LEN)
+    flush_output();
+  outbuf[outlen++] = c;
+}
+
+void out_long(long l)
+{
+  char digits[24];
+  char *p = digits + sizeof(digits);
+  unsigned long u = l < 0 ? -(unsigned long)l : (unsigned long)l;
+  do
+    *--p = '0' + u % 10;
+  while ((u /= 10) != 0);
+  if (l < 0)
+    *--p = '-';
+  out_bytes(p, digits + sizeof(digits) - p);
+}
+
+/* display writes strings and characters as they are, and everything
+   else as write does */
+void out_value(scm x, int display);
 
-void write_pair(block *pair)
+void write_pair(block *pair, int display)
 {
-  write(CAR(pair));
+  out_value(CAR(pair), display);
   scm cdr = CDR(pair);
-  if (cdr == null);
-  else if (IS_PAIR(cdr)) {
-    printf(" ");
-    write_pair((block *)cdr);
+  for (; IS_PAIR(cdr); cdr = CDR(cdr)) {
+    out_char(' ');
+    out_value(CAR(cdr), display);
   }
-  else {
-    printf(" . ");
-    write(cdr);
+  if (cdr != null) {
+    out_string(" . ");
+    out_value(cdr, display);
+  }
+}
+
+void write_string(char *s)
+{
+  out_char('"');
+  for (char *c = s; *c != '\0'; ++c) {
+    size_t n = strcspn(c, "\"\n\\");
+    out_bytes(c, n);
+    c += n;
+    switch (*c) {
+    case '"':
+      out_string("\\\"");
+      break;
+    case '\n':
+      out_string("\\n");
+      break;
+    case '\\':
+      out_string("\\\\");
+      break;
+    default:
+      --c;
+    }
   }
+  out_char('"');
 }
 
-void write_block(block *scm_val)
+void write_block(block *scm_val, int display)
 {
   if (TAGGED(scm_val->header, headermask, symboltag))
-    printf("%s", (char *)scm_val->data);
-  else if (TAGGED(scm_val->header, headermask, stringtag))
-    printf("\"%s\"", (char *)scm_val->data);
+    out_string(SYMBOL_NAME(scm_val));
+  else if (TAGGED(scm_val->header, headermask, stringtag)) {
+    if (display)
+      out_string((char *)scm_val->data);
+    else
+      write_string((char *)scm_val->data);
+  }
   else if (TAGGED(scm_val->header, headermask, pairtag)) {
-    printf("(");
-    write_pair(scm_val);
-    printf(")");
+    out_char('(');
+    write_pair(scm_val, display);
+    out_char(')');
+  }
+  else if (TAGGED(scm_val->header, headermask, closuretag) ||
+           TAGGED(scm_val->header, headermask, variadictag))
+    out_string("#<procedure>");
+  else if (TAGGED(scm_val->header, headermask, porttag))
+    out_string("#<input-port>");
+  else {
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), "#<unknown block %p>", scm_val);
+    out_string(buffer);
   }
-  else if (TAGGED(scm_val->header, headermask, closuretag))
-    printf("#<procedure>");
-  else
-    printf("#<unknown block %p>", scm_val);
 }
 
-void write(scm scm_val)
+void out_value(scm scm_val, int display)
 {
   if (TAGGED(scm_val, fxmask, fxtag))
-    printf("%ld", (long)scm_val >> fxshift);
+    out_long((long)scm_val >> fxshift);
   else if (TAGGED(scm_val, bmask, btag))
-    printf("#%c", scm_val >> bshift ? 't' : 'f');
-  else if (TAGGED(scm_val, cmask, ctag))
-    printf("#\\%c", (char)(scm_val >> cshift));
+    out_string(scm_val >> bshift ? "#t" : "#f");
+  else if (TAGGED(scm_val, cmask, ctag)) {
+    if (!display)
+      out_string("#\\");
+    out_char((char)(scm_val >> cshift));
+  }
   else if (scm_val == null)
-    printf("()");
+    out_string("()");
+  else if (scm_val == eof)
+    out_string("#<eof>");
   else if (TAGGED(scm_val, immask, 0))
-    write_block((block *)scm_val);
-  else
-    printf("#<unknown immediate 0x%016zx>", scm_val);
+    write_block((block *)scm_val, display);
+  else {
+    char buffer[40];
+    snprintf(buffer, sizeof(buffer), "#<unknown immediate 0x%016zx>", scm_val);
+    out_string(buffer);
+  }
+}
+
+scm write(scm x)
+{
+  out_value(x, 0);
+  return null;
+}
+
+scm display(scm x)
+{
+  out_value(x, 1);
+  return null;
+}
+
+scm write_char(scm c)
+{
+  out_char((char)(c >> cshift));
+  return null;
+}
+
+/* error reports its arguments on stderr, strings as they are and the
+   rest as write does, after flushing what the program wrote */
+scm scm_error(size_t n, scm *args)
+{
+  flush_output();
+  outfile = stderr;
+  for (size_t i = 0; i < n; ++i) {
+    if (i > 0)
+      out_char(' ');
+    out_value(args[i], IS_STRING(args[i]));
+  }
+  out_char('\n');
+  flush_output();
+  exit(1);
 }
 
 void print_scm_val(scm scm_val)
 {
   write(scm_val);
-  printf("\n");
+  out_char('\n');
+  flush_output();
 }
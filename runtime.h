@@ -26,6 +26,11 @@
 #define ctag   10
 
 #define null 14
+#define eof 46
+
+/* returned in place of a value by a function which left a pending tail
+   call; never seen by Scheme code */
+#define TAILCALL 30
 
 typedef size_t scm;
 
@@ -37,6 +42,9 @@ typedef size_t scm;
 #define stringtag  2
 #define pairtag    3
 #define closuretag 4
+#define variadictag 5
+#define porttag    6
+#define forwardtag 15
 
 typedef struct {
   scm header;
@@ -45,17 +53,168 @@ typedef struct {
 
 #define CAR(pair) (((block*)pair)->data[0])
 #define CDR(pair) (((block*)pair)->data[1])
+#define SYMBOL_NAME(symbol) ((char *)(((block*)symbol)->data + 1))
 
-#define IS_PAIR(x) (TAGGED(x,immask,0) && TAGGED((((block*)x))->header,headermask,pairtag))
+#define IS_BLOCK(x, tag) (TAGGED(x,immask,0) && TAGGED((((block*)x))->header,headermask,tag))
+#define IS_PAIR(x) IS_BLOCK(x, pairtag)
+#define IS_SYMBOL(x) IS_BLOCK(x, symboltag)
+#define IS_STRING(x) IS_BLOCK(x, stringtag)
 
 #define VECTOR_LENGTH(x) (((block*)x)->header >> headershift)
 
+/* Garbage collection
+
+   Objects are bump-allocated in a nursery and promoted to an old
+   generation when they survive a minor collection. Compiled functions
+   keep every live scm value in an array of slots linked into gcstack,
+   and stores into heap objects go through vector_set so that old
+   objects pointing into the nursery are remembered. */
+
+typedef struct gcframe {
+  struct gcframe *prev;
+  size_t n;
+  scm *slots;
+} gcframe;
+
+extern gcframe *gcstack;
+
+#define ENTER_FRAME(s) gcframe frame = { gcstack, sizeof(s) / sizeof(scm), s }; gcstack = &frame
+#define LEAVE_FRAME (gcstack = frame.prev)
+
+#define IS_HEAP_PTR(x) ((x) != 0 && TAGGED(x, immask, 0))
+
+extern char *nurserystart;
+extern char *nurseryend;
+
+#define IS_YOUNG(x) (IS_HEAP_PTR(x) && (char *)(x) >= nurserystart && (char *)(x) < nurseryend)
+
+void remember(scm *slot);
+void gc_register_roots(scm *roots, size_t n);
+
+static inline scm vector_set(scm v, size_t i, scm x)
+{
+  scm *slot = &((block*)v)->data[i];
+  *slot = x;
+  if (IS_YOUNG(x) && !IS_YOUNG(v))
+    remember(slot);
+  return x;
+}
+
 scm allocvector(size_t len);
 scm allocsymbol(char *name, size_t len);
 scm allocstring(char *str, size_t len);
 scm cons(scm car, scm cdr);
 scm allocclosure(void *fp, size_t nfvs);
+scm allocvariadic(void *fp, size_t nfvs);
+
+/* Numbers and characters compare by value, symbols by name */
+static inline long compare(scm x, scm y)
+{
+  if (IS_SYMBOL(x) && IS_SYMBOL(y))
+    return strcmp(SYMBOL_NAME(x), SYMBOL_NAME(y));
+  return ((long)x > (long)y) - ((long)x < (long)y);
+}
+
+long list_length(scm list);
+scm string_append(scm x, scm y);
+scm number_to_string(scm n);
+scm string_to_number(scm string);
+scm symbol_to_string(scm symbol);
+scm string_to_symbol(scm string);
+
+scm open_input_file(scm path);
+scm close_port(scm port);
+scm read_datum(scm port);
+
+scm display(scm x);
+scm write(scm x);
+scm write_char(scm c);
+scm scm_error(size_t n, scm *args);
+
+extern scm command_line;
+void init_command_line(int argc, char **argv);
 
 void print_scm_val(scm scm_val);
+void flush_output();
+
+/* Tail calls
+
+   Generated code pops its frame before a tail call and makes the call
+   with musttail when the caller and callee have the same signature and
+   the C compiler supports it. Otherwise DEFER_CALL stores the function
+   and its arguments (the closure first, if it has one) and returns
+   TAILCALL, and the nearest non-tail call site, which wraps the call in
+   run_tail_calls, makes the pending call. */
+
+#define MAX_TAIL_ARGS 8
+
+extern void *tailfn;
+extern scm tailargs[MAX_TAIL_ARGS];
+extern size_t ntailargs;
+
+#define DEFER_CALL(fn, n, ...)                                          \
+  (tailfn = (void *)(fn),                                               \
+   memcpy(tailargs, (scm[]){ 0, __VA_ARGS__ } + 1, (n) * sizeof(scm)),   \
+   ntailargs = (n),                                                     \
+   TAILCALL)
+
+#if defined(__has_attribute)
+#if __has_attribute(musttail)
+#define MUSTTAIL __attribute__((musttail))
+#endif
+#endif
+
+#ifdef MUSTTAIL
+#define TAIL_CALL(fn, n, ...) MUSTTAIL return fn(__VA_ARGS__)
+#else
+#define TAIL_CALL(fn, n, ...) return DEFER_CALL(fn, n, __VA_ARGS__)
+#endif
+
+scm call_pending(void);
+
+static inline scm run_tail_calls(scm r)
+{
+  while (r == TAILCALL)
+    r = call_pending();
+  return r;
+}
+
+/* Variadic procedures
+
+   The C function of a procedure which takes any number of arguments is
+   given its closure and a list of the arguments, and its closure is
+   tagged variadictag, so a call through an unknown closure checks which
+   kind it has. type is the function type of a fixed-arity callee, and n
+   counts the closure among the arguments. */
+
+#define IS_VARIADIC(f) TAGGED(((block *)(f))->header, headermask, variadictag)
+
+scm call_variadic(size_t n, scm *args);
+
+#define CALL(type, n, f, ...)                                           \
+  (IS_VARIADIC(f)                                                       \
+   ? call_variadic((n), (scm[]){ f, __VA_ARGS__ })                      \
+   : ((type)((block *)(f))->data[0])(f, ##__VA_ARGS__))
+
+scm apply(scm proc, scm args);
+
+/* Allocation census
+
+   Built with -DSCHEME_CENSUS, the runtime counts the objects and bytes
+   allocated of each block type, and the closures made from each lambda,
+   and reports them on stderr at exit when SCHEME_CENSUS is set in the
+   environment. A compiled program passes census_init a table of its
+   closures' functions, ending with a null entry, which names each by the
+   lambda it came from. Without the define nothing is counted. */
+
+#ifdef SCHEME_CENSUS
+typedef struct {
+  void *fn;
+  char *name;
+  char *source;
+} census_lambda;
+
+void census_init(census_lambda *lambdas);
+#endif
 
 #endif
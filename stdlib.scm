@@ -48,10 +48,11 @@
       (cons (car lst) (append (cdr lst) x))))
 
 (define (reverse lst)
-  (if (null? lst)
-      '()
-      (append (reverse (cdr lst))
-	      (list (car lst)))))
+  (define (go lst acc)
+    (if (null? lst)
+        acc
+        (go (cdr lst) (cons (car lst) acc))))
+  (go lst '()))
 
 (define (assq obj alist)
   (if (null? alist)
@@ -60,6 +61,12 @@
 	  (car alist)
 	  (assq obj (cdr alist)))))
 
+(define (memq obj lst)
+  (cond
+   ((null? lst) #f)
+   ((eq? obj (car lst)) lst)
+   (else (memq obj (cdr lst)))))
+
 (define (assq-ref obj alist)
   (if (null? alist)
       #f
@@ -96,12 +103,12 @@
     (f (apply g args))))
 
 (define (const a)
-  (lambda () a))
+  (lambda args a))
 
 (define (intercalate x lst)
-  (if (< (length lst) 2)
+  (if (or (null? lst) (null? (cdr lst)))
       lst
-      (append (list (car lst) x) (intercalate x (cdr lst)))))
+      (cons (car lst) (cons x (intercalate x (cdr lst))))))
 
 (define (reduce f lst init)
   (if (null? lst)
@@ -149,5 +156,84 @@
    ((> (car a) (car b)) (set-difference a (cdr b)))
    (else (set-difference (cdr a) (cdr b)))))
 
+;; merges the sets pairwise, so each element takes part in only
+;; logarithmically many merges
+(define (set-union-all sets)
+  (define (merge-pairs sets)
+    (if (or (null? sets) (null? (cdr sets)))
+        sets
+        (cons (set-union (car sets) (cadr sets)) (merge-pairs (cddr sets)))))
+  (cond
+   ((null? sets) '())
+   ((null? (cdr sets)) (car sets))
+   (else (set-union-all (merge-pairs sets)))))
+
 (define (list->set lst)
-  (reduce set-union (map list lst) '()))
+  (set-union-all (map list lst)))
+
+;; Trees map keys, ordered like the elements of sets, to values. They
+;; are persistent red-black trees (Okasaki, "Red-Black Trees in a
+;; Functional Setting"): setting a key returns a new tree, sharing most
+;; of the old one. A node is (color left key value right).
+
+(define empty-tree '())
+
+(define (tree-left t) (cadr t))
+(define (tree-key t) (caddr t))
+(define (tree-value t) (cadddr t))
+(define (tree-right t) (car (cddddr t)))
+
+(define (red? t) (and (not (null? t)) (eq? (car t) 'red)))
+
+;; the value of key in tree, or #f
+(define (tree-ref key tree)
+  (cond
+   ((null? tree) #f)
+   ((< key (tree-key tree)) (tree-ref key (tree-left tree)))
+   ((> key (tree-key tree)) (tree-ref key (tree-right tree)))
+   (else (tree-value tree))))
+
+(define (tree-set key value tree)
+  (define (ins t)
+    (cond
+     ((null? t) (list 'red '() key value '()))
+     ((< key (tree-key t))
+      (tree-balance (car t) (ins (tree-left t)) (tree-key t) (tree-value t) (tree-right t)))
+     ((> key (tree-key t))
+      (tree-balance (car t) (tree-left t) (tree-key t) (tree-value t) (ins (tree-right t))))
+     (else (list (car t) (tree-left t) key value (tree-right t)))))
+  (let ((t (ins tree)))
+    (cons 'black (cdr t))))
+
+;; a black node with a red child and grandchild becomes a red node with
+;; two black children
+(define (tree-balance color l k v r)
+  (define (node a xk xv b yk yv c zk zv d)
+    (list 'red (list 'black a xk xv b) yk yv (list 'black c zk zv d)))
+  (cond
+   ((not (eq? color 'black)) (list color l k v r))
+   ((and (red? l) (red? (tree-left l)))
+    (let ((ll (tree-left l)))
+      (node (tree-left ll) (tree-key ll) (tree-value ll) (tree-right ll)
+            (tree-key l) (tree-value l)
+            (tree-right l) k v r)))
+   ((and (red? l) (red? (tree-right l)))
+    (let ((lr (tree-right l)))
+      (node (tree-left l) (tree-key l) (tree-value l) (tree-left lr)
+            (tree-key lr) (tree-value lr)
+            (tree-right lr) k v r)))
+   ((and (red? r) (red? (tree-left r)))
+    (let ((rl (tree-left r)))
+      (node l k v (tree-left rl)
+            (tree-key rl) (tree-value rl)
+            (tree-right rl) (tree-key r) (tree-value r) (tree-right r))))
+   ((and (red? r) (red? (tree-right r)))
+    (let ((rr (tree-right r)))
+      (node l k v (tree-left r)
+            (tree-key r) (tree-value r)
+            (tree-left rr) (tree-key rr) (tree-value rr) (tree-right rr))))
+   (else (list color l k v r))))
+
+;; a tree mapping each of keys to value
+(define (tree-set-all keys value tree)
+  (reduce (lambda (key tree) (tree-set key value tree)) keys tree))
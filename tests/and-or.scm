@@ -0,0 +1 @@
+(list (and) (and 1 2) (and 1 #f 2) (or) (or #f 3) (or #f #f))
@@ -0,0 +1,8 @@
+(let ((f (lambda (a b c d) (list d c b a)))
+      (app apply)
+      (add +))
+  (list (apply f 1 2 '(3 4))
+        (apply f 1 2 3 4 '())
+        (app f 1 '(2 3 4))
+        (apply + 1 2 '(3 4))
+        (add 1 2 3)))
@@ -0,0 +1,2 @@
+(cons (apply (lambda (a b c) (list c b a)) '(1 2 3))
+      (apply + '(1 2 3 4)))
@@ -0,0 +1,3 @@
+(cons (if (fx< (fx+ 1 2) (fx* 2 2)) (fx- 50 8) 'no)
+      (cons (not (fxzero? (fxsub1 1)))
+            (cons (eq? 'a 'a) (null? '()))))
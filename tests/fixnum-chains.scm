@@ -0,0 +1,6 @@
+(define (f a b c)
+  (if (fx< (fx+ a b) c)
+      (fx* (fx- a 1) (fx+ b -2))
+      (vector-ref (vector 10 20 30) (fx- a (fx* b 4)))))
+
+(cons (f -3 1 0) (cons (f 5 1 2) (fx< -1 1)))
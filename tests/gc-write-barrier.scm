@@ -0,0 +1,24 @@
+(define (build n acc)
+  (if (fx= n 0) acc (build (fx- n 1) (cons n acc))))
+
+(define (sum l)
+  (if (null? l) 0 (fx+ (car l) (sum (cdr l)))))
+
+(define (churn i)
+  (if (fx= i 0) 0 (begin (build 100 '()) (churn (fx- i 1)))))
+
+(define (fill v i)
+  (if (fx= i 0)
+      v
+      (begin
+        (set! (vector-ref v (fxsub1 i)) (build i '()))
+        (churn 1000)
+        (fill v (fxsub1 i)))))
+
+(define (total v i)
+  (if (fx= i 0) 0 (fx+ (sum (vector-ref v (fxsub1 i))) (total v (fxsub1 i)))))
+
+(let ((v (make-vector 100)))
+  (churn 1000)
+  (fill v 100)
+  (total v 100))
@@ -0,0 +1 @@
+(if '#f 1 2)
@@ -0,0 +1,6 @@
+(let ((x 1))
+  (let ((f (lambda (y) (fx+ x y)))
+        (b x))
+    (let ((x 10))
+      (set! b (fxadd1 b))
+      (cons (f x) (cons x b)))))
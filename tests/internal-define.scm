@@ -0,0 +1,5 @@
+(define (sum-to n)
+  (define (go i acc)
+    (if (fx> i n) acc (go (fxadd1 i) (fx+ acc i))))
+  (go 0 0))
+(sum-to 10)
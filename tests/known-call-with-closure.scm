@@ -0,0 +1,6 @@
+(define (parity n)
+  (letrec ((even (lambda (k) (if (fx= k n) #t (odd (fxadd1 k)))))
+           (odd (lambda (k) (if (fx= k n) #f (even (fxadd1 k))))))
+    (cons (even 0) ((lambda () (odd 0))))))
+
+(parity 5)
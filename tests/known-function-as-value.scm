@@ -0,0 +1,7 @@
+(define (twice f x)
+  (f (f x)))
+
+(define (inc x)
+  (fxadd1 x))
+
+(cons (inc 1) (twice inc 5))
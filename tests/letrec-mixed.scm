@@ -0,0 +1,5 @@
+(letrec ((ev? (lambda (n) (if (fxzero? n) #t (od? (fxsub1 n)))))
+         (od? (lambda (n) (if (fxzero? n) #f (ev? (fxsub1 n)))))
+         (base 7)
+         (parity (cons (ev? base) (od? base))))
+  (cons base parity))
@@ -0,0 +1,6 @@
+(define (main args)
+  (display "args: ")
+  (write args)
+  (write-char #\newline)
+  (display (list "a" #\b 'c))
+  (write-char #\newline))
@@ -0,0 +1,2 @@
+(let ((f (lambda () '(a "b" (c)))))
+  (eq? (f) (f)))
@@ -0,0 +1,7 @@
+(define (sum n acc)
+  (set! acc (fx+ acc n))
+  (if (fxzero? n)
+      acc
+      (sum (fxsub1 n) acc)))
+
+(sum 100000 0)
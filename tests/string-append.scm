@@ -0,0 +1 @@
+(string-append "x = " (number->string -42) ", " (symbol->string 'y) "!")
@@ -0,0 +1,3 @@
+(list (string->number "42") (string->number "-7") (string->number "4x") (string->number "")
+      (string->number " 12") (string->number "+12") (string->number "-")
+      (string->number "99999999999999999999") (string->number "4611686018427387904"))
@@ -0,0 +1 @@
+(cons (eq? 'abc 'ab) 'ab)
@@ -0,0 +1,9 @@
+(define (count-down n)
+  (if (fxzero? n)
+      #t
+      (step n 1)))
+
+(define (step n by)
+  (count-down (fx- n by)))
+
+(count-down 100000000)
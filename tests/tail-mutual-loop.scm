@@ -0,0 +1,11 @@
+(define (ping n)
+  (if (fxzero? n)
+      'ping
+      (pong (fx- n 1))))
+
+(define (pong n)
+  (if (fxzero? n)
+      'pong
+      (ping (fx- n 1))))
+
+(ping 100000000)
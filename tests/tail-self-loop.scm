@@ -0,0 +1,6 @@
+(define (loop n acc)
+  (if (fxzero? n)
+      acc
+      (loop (fx- n 1) (fx+ acc 2))))
+
+(loop 100000000 0)
@@ -0,0 +1,3 @@
+(define (unused x) (undefined-procedure x))
+(define (used x) (fxadd1 x))
+(used 41)
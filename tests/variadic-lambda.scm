@@ -0,0 +1,2 @@
+(let ((f (lambda (a b . rest) (list rest b a))))
+  (cons (f 1 2) (f 1 2 3 4)))